@@ -0,0 +1,363 @@
+// Batch calibration of archived sessions
+//
+// Usage: batchcal [-j jobs] [-R rate] [-O ratio] [-m] [-r] [-g uT] [-p policy]
+//                 [-S seed] [-P usec] session_or_directory ...
+//
+// Calibrates every session independently, through the same parser and
+// raw_data() path the GUI uses, and prints one JSON line per session
+// with the calibration found, its quality metrics and the samples it
+// consumed.  Sessions are captured serial bytes in either wire format,
+// or recordings (imuread -w).  Directories are searched recursively.
+//
+//   -j jobs    worker processes (default: one per online CPU)
+//   -R rate    sample rate of the sessions (default 100)
+//   -O ratio   gyro readings per orientation update (default 4)
+//   -m         multi-hypothesis solving
+//   -r         Levenberg-Marquardt refinement
+//   -g uT      novelty gate distance (default 1.0, 0 = off)
+//   -p policy  buffer retention policy: classic (default), coverage or
+//              reservoir
+//   -S seed    seed for the calibration's random choices (default 1)
+//   -P usec    schedule solves as if each took usec rather than by their
+//              measured cost.  Busy workers slow each other's solves, so
+//              without this the results can differ from run to run.
+//
+// The calibration state is global, so each worker is a forked process
+// rather than a thread.  Workers take the next session from a counter
+// in shared memory, so a few long captures don't hold up the rest, and
+// send their lines to the parent over a pipe, each in a single write()
+// so lines never interleave.  A worker that crashes is replaced, and the
+// session it was on gets an error line.  Results come out in completion
+// order, not input order.
+
+#include "imuread.h"
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#define MAX_JOBS   256
+#define LINE_MAX_LEN 4000   // under PIPE_BUF, so a line is one atomic write
+
+typedef struct {
+	volatile uint32_t next;           // next session to take
+	volatile uint32_t calibrated;
+	volatile uint32_t failed;
+	volatile uint64_t samples;
+	volatile int32_t current[MAX_JOBS];  // session each worker is on, -1 = none
+} BatchShared_t;
+
+static char **sessions;
+static uint32_t nsessions = 0;
+static uint32_t maxsessions = 0;
+static BatchShared_t *shared;
+static int outfd = -1;
+
+void calibration_confirmed(void)
+{
+}
+
+static void add_session(const char *path)
+{
+	char **p;
+
+	if (nsessions == maxsessions) {
+		maxsessions = maxsessions ? maxsessions * 2 : 256;
+		p = (char **)realloc(sessions, maxsessions * sizeof(char *));
+		if (p == NULL) {
+			fprintf(stderr, "batchcal: out of memory\n");
+			exit(1);
+		}
+		sessions = p;
+	}
+	sessions[nsessions++] = strdup(path);
+}
+
+static int select_file(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+static void session_or_directory(const char *path)
+{
+	struct dirent **list;
+	struct stat st;
+	char name[1024];
+	int i, n;
+
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		// sorted, so the sessions are taken in a repeatable order
+		n = scandir(path, &list, select_file, alphasort);
+		for (i=0; i < n; i++) {
+			snprintf(name, sizeof(name), "%s/%s", path, list[i]->d_name);
+			if (stat(name, &st) == 0) {
+				if (S_ISDIR(st.st_mode)) session_or_directory(name);
+				else if (S_ISREG(st.st_mode)) add_session(name);
+			}
+			free(list[i]);
+		}
+		if (n >= 0) free(list);
+	} else {
+		add_session(path);
+	}
+}
+
+static void send_line(const char *line, int len)
+{
+	if (len >= LINE_MAX_LEN) len = LINE_MAX_LEN - 1;
+	while (write(outfd, line, len) < 0 && errno == EINTR) ;
+}
+
+// filename as the contents of a JSON string, cut short rather than
+// mid-escape if it doesn't fit
+static const char * json_escape(const char *filename, char *buf, int size)
+{
+	int n=0;
+
+	for (; *filename; filename++) {
+		if (n + 7 > size) break;
+		if (*filename == '"' || *filename == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = *filename;
+		} else if ((unsigned char)*filename < 0x20) {
+			n += snprintf(buf + n, size - n, "\\u%04x", (unsigned char)*filename);
+		} else {
+			buf[n++] = *filename;
+		}
+	}
+	buf[n] = 0;
+	return buf;
+}
+
+static void error_line(const char *filename, const char *error)
+{
+	char line[LINE_MAX_LEN], name[LINE_MAX_LEN / 2];
+	int len;
+
+	len = snprintf(line, sizeof(line), "{\"session\":\"%s\",\"error\":\"%s\"}\n",
+		json_escape(filename, name, sizeof(name)), error);
+	send_line(line, len);
+	__sync_fetch_and_add(&shared->failed, 1);
+}
+
+// The display recomputes the quality metrics every frame, and the classic
+// retention policy decides with them, so they are kept as fresh here:
+// recomputed after every sample, as ttcbench does.
+static void refresh_quality(uint32_t *samples)
+{
+	MagCalSched_t st;
+
+	magcal_sched_stats(&st);
+	if (st.samples == *samples) return;
+	*samples = st.samples;
+	quality_refresh();
+}
+
+static int replay(const char *filename)
+{
+	RecReader_t rd;
+	RecRecord_t rec;
+	unsigned char buf[4096];
+	uint32_t samples=0;
+	FILE *fp;
+	int i, n;
+
+	raw_data_reset();
+	newdata_reset();  // not the tail of this worker's last capture
+	if (recording_open(&rd, filename)) {
+		while (recording_next(&rd, &rec)) {
+			if (rec.type == REC_SAMPLE) {
+				raw_data_timed(rec.data, rec.has_time ? &rec.time : NULL);
+				refresh_quality(&samples);
+			}
+		}
+		recording_close(&rd);
+		return 1;
+	}
+	fp = fopen(filename, "rb");
+	if (fp == NULL) return 0;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		// a byte at a time, so every sample is seen as it completes.  No
+		// host timestamps: the nominal rate, or the sensor clock.
+		for (i=0; i < n; i++) {
+			newdata_timed(buf + i, 1, 0);
+			refresh_quality(&samples);
+		}
+	}
+	fclose(fp);
+	return 1;
+}
+
+static void calibrate(const char *filename)
+{
+	MagCalSched_t st;
+	char line[LINE_MAX_LEN], name[LINE_MAX_LEN / 2];
+	clock_t c0;
+	int len;
+
+	c0 = clock();
+	if (!replay(filename)) {
+		error_line(filename, "unreadable");
+		return;
+	}
+	magcal_sched_stats(&st);
+	if (st.samples == 0) {
+		error_line(filename, "no samples");
+		return;
+	}
+	quality_refresh();
+	len = snprintf(line, sizeof(line), "{\"session\":\"%s\",\"samples\":%u,"
+		"\"valid\":%d,\"V\":[%.3f,%.3f,%.3f],"
+		"\"invW\":[[%.5f,%.5f,%.5f],[%.5f,%.5f,%.5f],[%.5f,%.5f,%.5f]],"
+		"\"B\":%.3f,\"fit_error\":%.2f,\"gaps\":%.2f,\"variance\":%.2f,"
+		"\"wobble\":%.2f,\"quality_fit\":%.2f,\"first_valid\":%u,"
+		"\"solves\":%u,\"cpu_secs\":%.4f}\n",
+		json_escape(filename, name, sizeof(name)), st.samples,
+		magcal.ValidMagCal, magcal.V[0], magcal.V[1], magcal.V[2],
+		magcal.invW[0][0], magcal.invW[0][1], magcal.invW[0][2],
+		magcal.invW[1][0], magcal.invW[1][1], magcal.invW[1][2],
+		magcal.invW[2][0], magcal.invW[2][1], magcal.invW[2][2],
+		magcal.B, magcal.FitError, quality_surface_gap_error(),
+		quality_magnitude_variance_error(), quality_wobble_error(),
+		quality_spherical_fit_error(), st.first_valid, st.solves,
+		(double)(clock() - c0) / CLOCKS_PER_SEC);
+	send_line(line, len);
+	if (magcal.ValidMagCal) __sync_fetch_and_add(&shared->calibrated, 1);
+	__sync_fetch_and_add(&shared->samples, st.samples);
+}
+
+static void worker(int id)
+{
+	uint32_t i;
+
+	while ((i = __sync_fetch_and_add(&shared->next, 1)) < nsessions) {
+		shared->current[id] = i;
+		calibrate(sessions[i]);
+		shared->current[id] = -1;
+	}
+	_exit(0);
+}
+
+static pid_t start_worker(pid_t *pids, int id)
+{
+	pid_t pid;
+
+	shared->current[id] = -1;
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) worker(id);
+	pids[id] = pid;
+	return pid;
+}
+
+// copy whatever the workers have sent to stdout
+static void drain(int fd)
+{
+	char buf[16384];
+	int n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, n, stdout);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t pids[MAX_JOBS], pid;
+	float rate=SENSORFS, novelty=-1.0f;
+	uint64_t seed=1, start;
+	struct timeval tv;
+	fd_set rfds;
+	int i, id, jobs, running=0, status, fds[2], ratio=OVERSAMPLE_RATIO;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i=1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			jobs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-O") == 0 && i + 1 < argc) {
+			ratio = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0) {
+			magcal_set_multi(1);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			magcal_set_refine(1);
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			novelty = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			if (!retention_set_policy(argv[++i])) goto usage;
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			magcal_set_sched_cost(atof(argv[++i]));
+		} else {
+			goto usage;
+		}
+	}
+	if (i >= argc) goto usage;
+	if (jobs < 1) jobs = 1;
+	if (jobs > MAX_JOBS) jobs = MAX_JOBS;
+	if (!raw_data_set_rate(rate, ratio)) {
+		fprintf(stderr, "batchcal: bad sample rate or oversample ratio\n");
+		return 1;
+	}
+	if (novelty >= 0.0f) raw_data_set_novelty(novelty);
+	raw_data_set_seed(seed);
+	for (; i < argc; i++) {
+		session_or_directory(argv[i]);
+	}
+	if ((uint32_t)jobs > nsessions) jobs = nsessions ? nsessions : 1;
+
+	shared = (BatchShared_t *)mmap(NULL, sizeof(BatchShared_t),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED || pipe(fds) != 0) {
+		fprintf(stderr, "batchcal: unable to set up the workers\n");
+		return 1;
+	}
+	memset((void *)shared, 0, sizeof(BatchShared_t));
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	outfd = fds[1];
+	start = monotonic_ns();
+	for (id=0; id < jobs; id++) {
+		if (start_worker(pids, id) > 0) running++;
+	}
+	if (running == 0) {
+		fprintf(stderr, "batchcal: unable to start the workers\n");
+		return 1;
+	}
+
+	// the parent keeps the pipe's write end, to hand it to replacements,
+	// so it watches the workers rather than waiting for end of file
+	while (running > 0) {
+		FD_ZERO(&rfds);
+		FD_SET(fds[0], &rfds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (select(fds[0] + 1, &rfds, NULL, NULL, &tv) > 0) drain(fds[0]);
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (id=0; id < jobs && pids[id] != pid; id++) ;
+			if (id == jobs) continue;
+			running--;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+			drain(fds[0]);
+			if (shared->current[id] >= 0) {
+				error_line(sessions[shared->current[id]], WIFSIGNALED(status) ?
+					strsignal(WTERMSIG(status)) : "worker failed");
+			}
+			if (shared->next < nsessions && start_worker(pids, id) > 0) running++;
+		}
+	}
+	drain(fds[0]);
+	printf("{\"sessions\":%u,\"calibrated\":%u,\"failed\":%u,\"jobs\":%d,"
+		"\"samples\":%llu,\"wall_secs\":%.3f}\n", nsessions, shared->calibrated,
+		shared->failed, jobs, (unsigned long long)shared->samples,
+		(monotonic_ns() - start) * 1e-9);
+	return shared->failed ? 2 : 0;
+usage:
+	fprintf(stderr, "Usage: batchcal [-j jobs] [-R rate] [-O ratio] [-m] [-r] "
+		"[-g uT] [-p classic|coverage|reservoir]\n"
+		"  [-S seed] [-P usec] session_or_directory ...\n");
+	return 1;
+}
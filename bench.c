@@ -0,0 +1,297 @@
+// Solver microbenchmarks for magcal.c and matrix.c
+//
+// Usage: magbench [recorded_raw_file ...]
+//
+// Every benchmark runs on a deterministic synthetic buffer, and again on
+// each recorded file given (the "Raw:" lines of a captured serial session),
+// at several buffer fill levels.  One JSON object per line is written to
+// stdout, so the output of two commits can be compared with diff or jq.
+// Times are per call; "tsc" is the x86 timestamp counter per call (0 on
+// other CPUs); "sweeps" and "iterations" are the work the solver reports.
+
+#include "imuread.h"
+
+#define BENCH_MIN_NS    200000000 // run each benchmark for at least 0.2 s
+#define BENCH_MIN_CALLS 20
+#define BENCH_MAX_POINTS 65536
+
+static const int fill_levels[] = {40, 100, 150, MAGBUFFSIZE};
+static const int accum_levels[] = {40, 100, 150, MAGBUFFSIZE, 4096, BENCH_MAX_POINTS};
+
+static int16_t points[3][BENCH_MAX_POINTS];
+static int npoints;
+static MagCalibration_t cal;
+static const char *source;
+
+void calibration_confirmed(void)
+{
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static uint64_t tsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+#else
+static uint64_t tsc(void)
+{
+	return 0;
+}
+#endif
+
+// fixed sequence, so every run and every commit sees the same buffer
+static uint32_t lcg_state;
+static float lcg_uniform(void)
+{
+	lcg_state = lcg_state * 1664525 + 1013904223;
+	return (float)(lcg_state >> 8) / 16777216.0f;
+}
+
+// readings on a tilted, offset ellipsoid with a little noise
+static void synthetic_points(void)
+{
+	float u, v, x, y, z;
+	int i;
+
+	lcg_state = 12345;
+	for (i=0; i < BENCH_MAX_POINTS; i++) {
+		u = lcg_uniform() * 2.0f - 1.0f;
+		v = lcg_uniform() * 2.0f * M_PI;
+		x = sqrtf(1.0f - u * u) * cosf(v) * 50.0f;
+		y = sqrtf(1.0f - u * u) * sinf(v) * 50.0f;
+		z = u * 50.0f;
+		x = 1.08f * x + 0.04f * y + 12.0f;
+		y = 0.04f * x + 0.95f * y - 31.0f;
+		z = 1.02f * z - 0.03f * x + 7.5f;
+		x += (lcg_uniform() - 0.5f) * 0.6f;
+		y += (lcg_uniform() - 0.5f) * 0.6f;
+		z += (lcg_uniform() - 0.5f) * 0.6f;
+		points[0][i] = (int16_t)lrintf(x / UT_PER_COUNT);
+		points[1][i] = (int16_t)lrintf(y / UT_PER_COUNT);
+		points[2][i] = (int16_t)lrintf(z / UT_PER_COUNT);
+	}
+	npoints = BENCH_MAX_POINTS;
+	source = "synthetic";
+}
+
+// magnetometer fields of the "Raw:" lines in a captured session
+static int recorded_points(const char *filename)
+{
+	FILE *fp;
+	char line[256];
+	int d[9];
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) return 0;
+	npoints = 0;
+	while (npoints < BENCH_MAX_POINTS && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "Raw:%d,%d,%d,%d,%d,%d,%d,%d,%d", &d[0], &d[1],
+		  &d[2], &d[3], &d[4], &d[5], &d[6], &d[7], &d[8]) != 9) continue;
+		points[0][npoints] = d[6];
+		points[1][npoints] = d[7];
+		points[2][npoints] = d[8];
+		npoints++;
+	}
+	fclose(fp);
+	source = filename;
+	return npoints;
+}
+
+static void fill_buffer(int n)
+{
+	int i, j;
+
+	memset(&cal, 0, sizeof(cal));
+	for (i=0; i < n; i++) {
+		j = i % npoints;
+		cal.BpFast[0][i] = points[0][j];
+		cal.BpFast[1][i] = points[1][j];
+		cal.BpFast[2][i] = points[2][j];
+		cal.valid[i] = 1;
+	}
+	cal.MagBufferCount = n;
+}
+
+// ellipsoid normal matrix X^T.X of the 10EIG measurement vectors, as
+// eigencompute() sees it inside the 7EIG (n=7) and 10EIG (n=10) solvers
+static void normal_matrix(float A[][10], int size, int n)
+{
+	double sum[10][10];
+	float x, y, z, vec[10];
+	int i, j, k;
+
+	memset(sum, 0, sizeof(sum));
+	for (i=0; i < n; i++) {
+		x = (points[0][i % npoints] - points[0][0]) * UT_PER_COUNT;
+		y = (points[1][i % npoints] - points[1][0]) * UT_PER_COUNT;
+		z = (points[2][i % npoints] - points[2][0]) * UT_PER_COUNT;
+		if (size == 7) {
+			vec[0] = x * x; vec[1] = y * y; vec[2] = z * z;
+			vec[3] = x; vec[4] = y; vec[5] = z; vec[6] = 1.0f;
+		} else {
+			vec[0] = x * x; vec[1] = 2.0f * x * y; vec[2] = 2.0f * x * z;
+			vec[3] = y * y; vec[4] = 2.0f * y * z; vec[5] = z * z;
+			vec[6] = x; vec[7] = y; vec[8] = z; vec[9] = 1.0f;
+		}
+		for (j=0; j < size; j++) {
+			for (k=0; k < size; k++) {
+				sum[j][k] += vec[j] * vec[k];
+			}
+		}
+	}
+	for (j=0; j < size; j++) {
+		for (k=0; k < size; k++) {
+			A[j][k] = sum[j][k] / (double)n;
+		}
+	}
+}
+
+static void copy_block(float A[][10], float A0[][10], int first, int size)
+{
+	int i, j;
+
+	for (i=0; i < size; i++) {
+		for (j=0; j < size; j++) {
+			A[i][j] = A0[first + i][first + j];
+		}
+	}
+}
+
+static void report(const char *name, int fill, uint32_t calls,
+	uint64_t ns, uint64_t cycles, const char *work, double amount)
+{
+	printf("{\"bench\":\"%s\",\"source\":\"%s\",\"fill\":%d,\"calls\":%u,"
+		"\"ns\":%.1f,\"tsc\":%.1f", name, source, fill, calls,
+		(double)ns / calls, (double)cycles / calls);
+	if (work) printf(",\"%s\":%.2f", work, amount / calls);
+	printf("}\n");
+	fflush(stdout);
+}
+
+// timed loop shared by all benchmarks; the setup (restoring the input the
+// call destroys) runs outside the timed region
+#define BENCH_LOOP(name, fill, setup, call, work, amount) do { \
+	uint64_t t0, c0, ns=0, cycles=0; \
+	uint32_t calls=0; \
+	double total=0.0; \
+	while (ns < BENCH_MIN_NS || calls < BENCH_MIN_CALLS) { \
+		setup; \
+		c0 = tsc(); \
+		t0 = monotonic_ns(); \
+		call; \
+		ns += monotonic_ns() - t0; \
+		cycles += tsc() - c0; \
+		total += (amount); \
+		calls++; \
+	} \
+	report(name, fill, calls, ns, cycles, work, total); \
+} while (0)
+
+static void bench_solvers(void)
+{
+	MagCalibration_t solved;
+	int i, n, iter=0;
+
+	for (i=0; i < sizeof(fill_levels) / sizeof(int); i++) {
+		n = fill_levels[i];
+		fill_buffer(n);
+		BENCH_LOOP("fUpdateCalibration4INV", n, ,
+			fUpdateCalibration4INV(&cal), NULL, 0);
+		BENCH_LOOP("fUpdateCalibration7EIG", n, ,
+			fUpdateCalibration7EIG(&cal), "sweeps", cal.EigSweeps);
+		BENCH_LOOP("fUpdateCalibration10EIG", n, ,
+			fUpdateCalibration10EIG(&cal), "sweeps", cal.EigSweeps);
+		fUpdateCalibration10EIG(&cal);
+		solved = cal;
+		BENCH_LOOP("fRefineCalibrationLM", n, cal = solved,
+			iter = fRefineCalibrationLM(&cal, 1000000000), "iterations", iter);
+	}
+}
+
+static void bench_accumulator(void)
+{
+	MagCalAccum_t acc;
+	int i, j, n;
+
+	for (i=0; i < sizeof(accum_levels) / sizeof(int); i++) {
+		n = accum_levels[i];
+		if (n > npoints) continue;
+		BENCH_LOOP("magcal_accum_add", n, magcal_accum_init(&acc),
+			for (j=0; j < n; j++) magcal_accum_add(&acc, points[0][j],
+			points[1][j], points[2][j]), "samples", n);
+		// below the 10 element solver's minimum the solve returns at once
+		if (n < 150) continue;
+		BENCH_LOOP("magcal_accum_solve", n, ,
+			magcal_accum_solve(&acc, &cal), "sweeps", cal.EigSweeps);
+	}
+	// the continuous mode cost paid on every sample
+	magcal_set_continuous(60.0f);
+	n = npoints;
+	BENCH_LOOP("magcal_continuous_add", n, ,
+		for (j=0; j < n; j++) magcal_continuous_add(points[0][j],
+		points[1][j], points[2][j]), "samples", n);
+	magcal_set_continuous(0.0f);
+}
+
+static void bench_matrix(void)
+{
+	float A[10][10], A0[10][10], eigval[10], eigvec[10][10];
+	float B3[3][3], invB3[3][3];
+	float *pfRows[10];
+	int8_t iColInd[10], iRowInd[10], iPivot[10];
+	int i, j, n, size, sweeps=0;
+
+	for (i=0; i < sizeof(fill_levels) / sizeof(int); i++) {
+		n = fill_levels[i];
+		for (size=7; size <= 10; size += 3) {
+			normal_matrix(A0, size, n);
+			BENCH_LOOP(size == 7 ? "eigencompute7" : "eigencompute10", n,
+				memcpy(A, A0, sizeof(A)),
+				sweeps = eigencompute(A, eigval, eigvec, size),
+				"sweeps", sweeps);
+		}
+		// the 4x4 normal matrix of the 4INV solver (x, y, z, 1) and a 9x9
+		// the size of the refinement's Hessian both use fmatrixAeqInvA()
+		normal_matrix(A0, 10, n);
+		for (size=4; size <= 9; size += 5) {
+			for (j=0; j < size; j++) pfRows[j] = A[j];
+			BENCH_LOOP(size == 4 ? "fmatrixAeqInvA4" : "fmatrixAeqInvA9", n,
+				copy_block(A, A0, size == 4 ? 6 : 0, size),
+				fmatrixAeqInvA(pfRows, iColInd, iRowInd, iPivot, size),
+				NULL, 0);
+		}
+	}
+	normal_matrix(A0, 10, MAGBUFFSIZE);
+	for (i=0; i < 3; i++) {
+		for (j=0; j < 3; j++) {
+			B3[i][j] = A0[i][j];
+		}
+	}
+	BENCH_LOOP("f3x3matrixAeqInvSymB", 0, , f3x3matrixAeqInvSymB(invB3, B3),
+		NULL, 0);
+}
+
+static void bench_all(void)
+{
+	bench_solvers();
+	bench_matrix();
+	bench_accumulator();
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	synthetic_points();
+	bench_all();
+	for (i=1; i < argc; i++) {
+		if (recorded_points(argv[i]) < fill_levels[0]) {
+			fprintf(stderr, "magbench: not enough Raw: data in %s\n", argv[i]);
+			continue;
+		}
+		bench_all();
+	}
+	return 0;
+}
@@ -0,0 +1,340 @@
+// Calibration daemon, for rigs where other processes read the sensors
+//
+// Usage: calibd [-s path] [-t port] [-c max] [-m MiB] [-R rate] [-L factor]
+//               [-i secs] [-I secs]
+//
+//   -s path    listen on this Unix socket (default MOTIONCAL_SOCKET, or
+//              /tmp/motioncal.sock); "" for none
+//   -t port    also listen on this TCP port, on 127.0.0.1 only
+//   -c max     concurrent connections (default 256), more are refused
+//   -m MiB     address space limit of each connection (default 64)
+//   -R rate    sample rate of the streams (default 100)
+//   -L factor  read each stream at most factor times the sample rate
+//              (default 4); faster senders are held back by the socket
+//   -i secs    status interval (default 1)
+//   -I secs    close connections idle this long (default 60)
+//
+// Each connection streams raw samples in either wire format, exactly as
+// the sensor sends them to a serial port, and gets its own calibration
+// session.  The daemon sends back a JSON status line every -i seconds,
+// and at once when the solver first finds a calibration, moves to a
+// higher order fit or the calibration becomes ready (all four quality
+// metrics good), with the calibration and the quality metrics.  A status line that doesn't
+// fit in the socket buffer, because the client isn't reading, is dropped;
+// the next one supersedes it.
+//
+// The calibration state is global, so each connection is served by its
+// own forked process rather than a thread.  That isolates sessions
+// completely, and bounds each one: memory by setrlimit(RLIMIT_AS), CPU by
+// the read rate limit (the solver scheduler already keeps solving within
+// its share of each sample period).
+
+#include "imuread.h"
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define RATE_BURST_SECS 0.5         // samples a connection may get ahead by
+
+static int max_conn = 256;
+static int mem_mib = 64;
+static float rate = SENSORFS;
+static float rate_factor = 4.0f;
+static float status_secs = 1.0f;
+static float idle_secs = 60.0f;
+static volatile sig_atomic_t stop = 0;
+static int listen_fd[2] = {-1, -1};  // Unix, TCP
+static pid_t *children;             // one per connection, 0 = free
+static int nconn = 0;
+
+void calibration_confirmed(void)
+{
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void on_child(int sig)
+{
+	// only interrupts pselect(), the children are reaped in the main loop
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	// a stale socket from a previous run, but never anything else
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) return -1;
+		unlink(path);
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_tcp(int port)
+{
+	struct sockaddr_in addr;
+	int fd, on=1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int quality_ready(void)
+{
+	return magcal.ValidMagCal && quality_surface_gap_error() < QUALITY_GAPS_OK
+	  && quality_magnitude_variance_error() < QUALITY_VARIANCE_OK
+	  && quality_wobble_error() < QUALITY_WOBBLE_OK
+	  && quality_spherical_fit_error() < QUALITY_FITERROR_OK;
+}
+
+static void send_status(int fd, int new_calibration)
+{
+	MagCalSched_t st;
+	char line[1024];
+	int len;
+
+	magcal_sched_stats(&st);
+	len = snprintf(line, sizeof(line), "{\"samples\":%u,\"solver\":%d,"
+		"\"new_calibration\":%d,\"V\":[%.3f,%.3f,%.3f],"
+		"\"invW\":[[%.5f,%.5f,%.5f],[%.5f,%.5f,%.5f],[%.5f,%.5f,%.5f]],"
+		"\"B\":%.3f,\"fit_error\":%.2f,\"gaps\":%.2f,\"variance\":%.2f,"
+		"\"wobble\":%.2f,\"quality_fit\":%.2f,\"ready\":%d}\n",
+		st.samples, magcal.ValidMagCal, new_calibration,
+		magcal.V[0], magcal.V[1], magcal.V[2],
+		magcal.invW[0][0], magcal.invW[0][1], magcal.invW[0][2],
+		magcal.invW[1][0], magcal.invW[1][1], magcal.invW[1][2],
+		magcal.invW[2][0], magcal.invW[2][1], magcal.invW[2][2],
+		magcal.B, magcal.FitError, quality_surface_gap_error(),
+		quality_magnitude_variance_error(), quality_wobble_error(),
+		quality_spherical_fit_error(), quality_ready());
+	send(fd, line, len, MSG_DONTWAIT);
+}
+
+// one connection's whole session, in its own process
+static void serve(int fd)
+{
+	struct rlimit rl;
+	struct timeval tv;
+	fd_set rfds;
+	MagCalSched_t st;
+	unsigned char buf[1024];
+	uint64_t start, now, last_data, next_status, allowed;
+	uint32_t samples=0, accepted=0;
+	int n, wait_ms, solver=0, ready=0;
+
+	rl.rlim_cur = rl.rlim_max = (rlim_t)mem_mib << 20;
+	setrlimit(RLIMIT_AS, &rl);
+	raw_data_reset();
+	start = last_data = monotonic_ns();
+	next_status = start + (uint64_t)(status_secs * 1e9);
+	while (!stop) {
+		now = monotonic_ns();
+		if (now - last_data >= (uint64_t)(idle_secs * 1e9)) break;
+		wait_ms = (next_status > now) ? (int)((next_status - now) / 1000000) + 1 : 0;
+		magcal_sched_stats(&st);
+		allowed = (uint64_t)(((now - start) * 1e-9 + RATE_BURST_SECS) * rate * rate_factor);
+		if (st.samples >= allowed) {
+			// over the rate limit: leave the data in the socket until it's due
+			tv.tv_sec = 0;
+			tv.tv_usec = (wait_ms < 10 ? wait_ms : 10) * 1000;
+			select(0, NULL, NULL, NULL, &tv);
+		} else {
+			FD_ZERO(&rfds);
+			FD_SET(fd, &rfds);
+			tv.tv_sec = wait_ms / 1000;
+			tv.tv_usec = (wait_ms % 1000) * 1000;
+			n = select(fd + 1, &rfds, NULL, NULL, &tv);
+			if (n < 0 && errno != EINTR) break;
+			if (n > 0) {
+				n = read(fd, buf, sizeof(buf));
+				if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) break;
+				if (n > 0) {
+					now = monotonic_ns();
+					newdata_timed(buf, n, now);
+					last_data = now;
+				}
+			}
+		}
+
+		magcal_sched_stats(&st);
+		if (st.samples != samples) {
+			samples = st.samples;
+			quality_refresh();
+		}
+		now = monotonic_ns();
+		if (now < next_status && magcal.ValidMagCal <= solver
+		  && quality_ready() == ready) continue;
+		solver = magcal.ValidMagCal;
+		ready = quality_ready();
+		send_status(fd, st.accepted != accepted);
+		accepted = st.accepted;
+		next_status = now + (uint64_t)(status_secs * 1e9);
+	}
+	magcal_sched_stats(&st);
+	send_status(fd, st.accepted != accepted);
+	close(fd);
+}
+
+static void reap(void)
+{
+	pid_t pid;
+	int i, status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i=0; i < max_conn; i++) {
+			if (children[i] == pid) {
+				children[i] = 0;
+				nconn--;
+				break;
+			}
+		}
+	}
+}
+
+static void accept_connection(int lfd)
+{
+	static const char busy[] = "{\"error\":\"too many connections\"}\n";
+	sigset_t chld;
+	pid_t pid;
+	int i, fd;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0) return;
+	if (nconn >= max_conn) {
+		send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+		close(fd);
+		return;
+	}
+	pid = fork();
+	if (pid == 0) {
+		signal(SIGCHLD, SIG_DFL);
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &chld, NULL);
+		for (i=0; i < 2; i++) {
+			if (listen_fd[i] >= 0) close(listen_fd[i]);
+		}
+		serve(fd);
+		_exit(0);
+	}
+	if (pid > 0) {
+		for (i=0; children[i]; i++) ;
+		children[i] = pid;
+		nconn++;
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path;
+	struct sigaction sa;
+	sigset_t chld, unblocked;
+	fd_set rfds;
+	int i, port=0, maxfd;
+
+	path = getenv("MOTIONCAL_SOCKET");
+	if (path == NULL) path = "/tmp/motioncal.sock";
+	for (i=1; i < argc; i++) {
+		if (i + 1 >= argc) goto usage;
+		if (strcmp(argv[i], "-s") == 0) path = argv[++i];
+		else if (strcmp(argv[i], "-t") == 0) port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0) max_conn = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-m") == 0) mem_mib = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-R") == 0) rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-L") == 0) rate_factor = atof(argv[++i]);
+		else if (strcmp(argv[i], "-i") == 0) status_secs = atof(argv[++i]);
+		else if (strcmp(argv[i], "-I") == 0) idle_secs = atof(argv[++i]);
+		else goto usage;
+	}
+	if (max_conn < 1 || mem_mib < 8 || rate_factor <= 0.0f || status_secs <= 0.0f
+	  || !raw_data_set_rate(rate, OVERSAMPLE_RATIO)) goto usage;
+	children = (pid_t *)calloc(max_conn, sizeof(pid_t));
+	if (children == NULL) return 1;
+	if (*path) {
+		listen_fd[0] = listen_unix(path);
+		if (listen_fd[0] < 0) {
+			fprintf(stderr, "calibd: unable to listen on %s\n", path);
+			return 1;
+		}
+	}
+	if (port > 0) {
+		listen_fd[1] = listen_tcp(port);
+		if (listen_fd[1] < 0) {
+			fprintf(stderr, "calibd: unable to listen on 127.0.0.1:%d\n", port);
+			return 1;
+		}
+	}
+	if (listen_fd[0] < 0 && listen_fd[1] < 0) goto usage;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = on_child;
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	// SIGCHLD only arrives inside pselect(), so none is lost between
+	// reap() and the wait
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &unblocked);
+
+	maxfd = (listen_fd[0] > listen_fd[1]) ? listen_fd[0] : listen_fd[1];
+	while (!stop) {
+		FD_ZERO(&rfds);
+		for (i=0; i < 2; i++) {
+			if (listen_fd[i] >= 0) FD_SET(listen_fd[i], &rfds);
+		}
+		reap();
+		if (pselect(maxfd + 1, &rfds, NULL, NULL, NULL, &unblocked) <= 0) continue;
+		for (i=0; i < 2; i++) {
+			if (listen_fd[i] >= 0 && FD_ISSET(listen_fd[i], &rfds)) {
+				accept_connection(listen_fd[i]);
+			}
+		}
+	}
+	// each connection sends its last status and closes
+	if (listen_fd[0] >= 0) unlink(path);
+	for (i=0; i < max_conn; i++) {
+		if (children[i]) kill(children[i], SIGTERM);
+	}
+	while (wait(NULL) > 0) ;
+	return 0;
+usage:
+	fprintf(stderr, "Usage: calibd [-s socket_path] [-t tcp_port] [-c max_connections] "
+		"[-m MiB] [-R rate]\n  [-L rate_factor] [-i status_secs] [-I idle_secs]\n");
+	return 1;
+}
@@ -131,8 +131,8 @@ typedef struct
 	Quaternion_t qMi;		// a priori orientation quaternion
 	float casq;			// FCA * FCA;
 	float cdsq;			// FCD * FCD;
-	float Fastdeltat;		// sensor sampling interval (s) = 1 / SENSORFS
-	float deltat;			// kalman filter sampling interval (s) = OVERSAMPLE_RATIO / SENSORFS
+	float Fastdeltat;		// sensor sampling interval (s) = 1 / sample rate
+	float deltat;			// kalman filter sampling interval (s) = oversample ratio / sample rate
 	float deltatsq;			// fdeltat * fdeltat
 	float QwbplusQvG;		// FQWB + FQVG
 	int16_t FirstOrientationLock;	// denotes that 9DOF orientation has locked to 6DOF
@@ -173,8 +173,8 @@ void fInit_9DOF_GBY_KALMAN(SV_9DOF_GBY_KALMAN_t *SV)
 	SV->FirstOrientationLock = 0;
 
 	// compute and store useful product terms to save floating point calculations later
-	SV->Fastdeltat = 1.0F / (float)SENSORFS;
-	SV->deltat = (float)OVERSAMPLE_RATIO * SV->Fastdeltat;
+	SV->Fastdeltat = 1.0F / raw_data_rate();
+	SV->deltat = (float)raw_data_oversample() * SV->Fastdeltat;
 	SV->deltatsq = SV->deltat * SV->deltat;
 	SV->casq = FCA_9DOF_GBY_KALMAN * FCA_9DOF_GBY_KALMAN;
 	SV->cdsq = FCD_9DOF_GBY_KALMAN * FCD_9DOF_GBY_KALMAN;
@@ -307,7 +307,11 @@ void fRun_9DOF_GBY_KALMAN(SV_9DOF_GBY_KALMAN_t *SV,
 	SV->qMi = SV->qPl;
 
 	// integrate the buffered high frequency (typically 200Hz) gyro readings
-	for (j = 0; j < OVERSAMPLE_RATIO; j++) {
+	// over their measured intervals
+	SV->deltat = 0.0F;
+	for (j = 0; j < raw_data_oversample(); j++) {
+		SV->Fastdeltat = Gyro->dtFast[j];
+		SV->deltat += SV->Fastdeltat;
 		// compute the incremental fast (typically 200Hz) rotation vector rvec (deg)
 		for (i = X; i <= Z; i++) {
 			rvec[i] = (Gyro->YpFast[j][i] - SV->bPl[i]) * SV->Fastdeltat;
@@ -320,6 +324,7 @@ void fRun_9DOF_GBY_KALMAN(SV_9DOF_GBY_KALMAN_t *SV,
 		// the a posteriori quaternion fqPl is re-normalized later so this update is stable
 		qAeqAxB(&(SV->qMi), &(SV->Deltaq));
 	}
+	SV->deltatsq = SV->deltat * SV->deltat;
 
 	// get the a priori rotation matrix from the a priori quaternion
 	fRotationMatrixFromQuaternion(SV->RMi, &(SV->qMi));
@@ -39,10 +39,13 @@ void MyCanvas::OnSize(wxSizeEvent& event)
 void MyCanvas::OnPaint( wxPaintEvent& WXUNUSED(event) )
 {
 	//printf("OnPaint\n");
+	TRACE_BEGIN();
 	wxPaintDC dc(this);
 	SetCurrent(*m_glRC);
 	display_callback();
 	SwapBuffers();
+	stats_frame_shown(current_orientation_time.host_ns);
+	TRACE_END("paint", 0);
 }
 
 void MyCanvas::InitGL()
@@ -251,6 +254,8 @@ void MyFrame::OnTimer(wxTimerEvent &event)
 	int i, j;
 
 	//printf("OnTimer\n");
+	stats_poll();
+	session_poll();
 	if (port_is_open()) {
 		read_serial_data();
 		if (firstrun && m_canvas->IsShown()) {
@@ -264,7 +269,8 @@ void MyFrame::OnTimer(wxTimerEvent &event)
 		variance = quality_magnitude_variance_error();
 		wobble = quality_wobble_error();
 		fiterror = quality_spherical_fit_error();
-		if (gaps < 15.0f && variance < 4.5f && wobble < 4.0f && fiterror < 5.0f) {
+		if (gaps < QUALITY_GAPS_OK && variance < QUALITY_VARIANCE_OK
+		  && wobble < QUALITY_WOBBLE_OK && fiterror < QUALITY_FITERROR_OK) {
 			if (!m_sendcal_menu->IsEnabled(ID_SENDCAL_MENU) || !m_button_sendcal->IsEnabled()) {
 				m_sendcal_menu->Enable(ID_SENDCAL_MENU, true);
 				m_button_sendcal->Enable(true);
@@ -308,6 +314,7 @@ void MyFrame::OnTimer(wxTimerEvent &event)
 	} else {
 		if (!port_name.IsEmpty()) {
 			//printf("port has closed, updating stuff\n");
+			session_close();
 			m_sendcal_menu->Enable(ID_SENDCAL_MENU, false);
 			m_button_clear->Enable(false);
 			m_button_sendcal->Enable(false);
@@ -391,6 +398,7 @@ void MyFrame::OnPortMenu(wxCommandEvent &event)
         int id = event.GetId();
         wxString name = m_port_menu->FindItem(id)->GetItemLabelText();
 
+	session_close();
 	close_port();
         //printf("OnPortMenu, id = %d, name = %s\n", id, (const char *)name);
 	port_name = name;
@@ -399,7 +407,7 @@ void MyFrame::OnPortMenu(wxCommandEvent &event)
 	m_port_list->SetSelection(0);
         if (id == 9000) return;
 	raw_data_reset();
-	open_port((const char *)name);
+	if (open_port((const char *)name)) session_open((const char *)name);
 	m_button_clear->Enable(true);
 }
 
@@ -409,11 +417,12 @@ void MyFrame::OnPortList(wxCommandEvent& event)
 	if (selected == wxNOT_FOUND) return;
 	wxString name = m_port_list->GetString(selected);
 	//printf("OnPortList, %s\n", (const char *)name);
+	session_close();
 	close_port();
 	port_name = name;
 	if (name == "(none)") return;
 	raw_data_reset();
-	open_port((const char *)name);
+	if (open_port((const char *)name)) session_open((const char *)name);
 	m_button_clear->Enable(true);
 }
 
@@ -440,6 +449,7 @@ void MyFrame::OnQuit( wxCommandEvent &event )
 MyFrame::~MyFrame(void)
 {
 	m_timer->Stop();
+	session_close();
 	close_port();
 }
 
@@ -456,6 +466,10 @@ bool MyApp::OnInit()
 {
 	// make sure we exit properly on macosx
 	SetExitOnFrameDelete(true);
+	stats_set_dump_path(NULL);
+	trace_start(NULL);
+	recording_start(NULL);
+	publish_start(NULL);
 
 	wxPoint pos(100, 100);
 
@@ -470,6 +484,9 @@ bool MyApp::OnInit()
 
 int MyApp::OnExit()
 {
+	trace_write(NULL);
+	recording_stop();
+	publish_stop();
 	return 0;
 }
 
@@ -0,0 +1,235 @@
+// Headless calibration, for station hosts with no display or OpenGL
+//
+// Usage: imuread-headless [options] [port]
+//
+//   -r rate       sensor sample rate (default 100)
+//   -o ratio      gyro readings per orientation update (default 4)
+//   -g uT         novelty gate distance
+//   -p policy     buffer retention policy
+//   -S seed       seed for the calibration's random choices
+//   -M file       write the pipeline statistics to file, Prometheus format
+//   -t file       record a Chrome trace, written at exit
+//   -w file       record the session
+//   -P name       publish every calibrated sample to shared memory, see
+//                 publish.c and shmtail
+//   -n            don't resume the device's saved session
+//   -i secs       print the status every secs seconds (default 1, 0 = never)
+//   -j            print the status as JSON lines instead of text
+//   -a            send the calibration as soon as all four quality metrics
+//                 are good, and exit once the sensor confirms it
+//   -T secs       give up after secs seconds (default 0 = never)
+//
+// The same pipeline as the GUI, driven by blocking waits on the port
+// rather than a timer and a redraw: the quality metrics are computed
+// straight from the buffer after each read.  Exits 0 when the calibration
+// is confirmed, 1 if the port fails, 2 on the -T timeout.  SIGINT and
+// SIGTERM stop it cleanly, saving the session, recording and trace.
+
+#include "imuread.h"
+#include <signal.h>
+
+#define CONFIRM_TIMEOUT_SECS 2.0    // resend if the sensor hasn't echoed it by then
+
+static volatile sig_atomic_t stop=0;
+static int confirmed=0;
+static int json=0;
+
+void calibration_confirmed(void)
+{
+	confirmed = 1;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void die(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+static void die(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(1);
+}
+
+static void write_trace(void)
+{
+	trace_write(NULL);
+}
+
+static int quality_ok(const float *q)
+{
+	return q[0] < QUALITY_GAPS_OK && q[1] < QUALITY_VARIANCE_OK
+	  && q[2] < QUALITY_WOBBLE_OK && q[3] < QUALITY_FITERROR_OK;
+}
+
+static void print_status(double secs, const float *q, int sent)
+{
+	MagCalSched_t st;
+	int i;
+
+	magcal_sched_stats(&st);
+	if (json) {
+		printf("{\"secs\":%.3f,\"samples\":%u,\"gaps\":%.2f,\"variance\":%.2f,"
+			"\"wobble\":%.2f,\"fit_error\":%.2f,\"ready\":%d,\"solver\":%d,"
+			"\"V\":[%.3f,%.3f,%.3f],\"invW\":[", secs, st.samples,
+			q[0], q[1], q[2], q[3], quality_ok(q), magcal.ValidMagCal,
+			magcal.V[0], magcal.V[1], magcal.V[2]);
+		for (i=0; i < 3; i++) {
+			printf("%s[%.5f,%.5f,%.5f]", i ? "," : "",
+				magcal.invW[i][0], magcal.invW[i][1], magcal.invW[i][2]);
+		}
+		printf("],\"B\":%.3f,\"sent\":%d,\"confirmed\":%d}\n", magcal.B,
+			sent, confirmed);
+	} else {
+		printf("%7.1f s %7u samples  gaps %5.1f%%  variance %4.1f%%  "
+			"wobble %4.1f%%  fit %4.1f%%  %s%s\n", secs, st.samples,
+			q[0], q[1], q[2], q[3],
+			!magcal.ValidMagCal ? "no calibration" :
+			quality_ok(q) ? "ready" : "calibrating",
+			confirmed ? ", confirmed" : sent ? ", sent" : "");
+	}
+	fflush(stdout);
+}
+
+static void print_calibration(void)
+{
+	if (json) return;
+	printf("Magnetic Calibration:   (%.1f%% fit error)\n", magcal.FitError);
+	printf("   %7.2f   %6.3f %6.3f %6.3f\n",
+		magcal.V[0], magcal.invW[0][0], magcal.invW[0][1], magcal.invW[0][2]);
+	printf("   %7.2f   %6.3f %6.3f %6.3f\n",
+		magcal.V[1], magcal.invW[1][0], magcal.invW[1][1], magcal.invW[1][2]);
+	printf("   %7.2f   %6.3f %6.3f %6.3f\n",
+		magcal.V[2], magcal.invW[2][0], magcal.invW[2][1], magcal.invW[2][2]);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *port = PORT, *trace = NULL, *record = NULL, *publish = NULL;
+	float rate = SENSORFS, novelty = -1.0f, interval = 1.0f, timeout = 0.0f;
+	float q[4] = {100.0f, 100.0f, 100.0f, 100.0f};
+	MagCalSched_t st;
+	uint64_t start, now, next_status, sent_ns=0;
+	uint32_t samples=0;
+	int i, n, ratio = OVERSAMPLE_RATIO, resume = 1, autosend = 0, sent = 0;
+	int wait_ms, status = 0;
+
+	stats_set_dump_path(NULL);
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			ratio = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			novelty = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			trace = argv[++i];
+		} else if (strcmp(argv[i], "-n") == 0) {
+			resume = 0;
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			record = argv[++i];
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			publish = argv[++i];
+		} else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+			stats_set_dump_path(argv[++i]);
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			raw_data_set_seed(strtoull(argv[++i], NULL, 0));
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			if (!retention_set_policy(argv[++i])) {
+				die("Retention policy must be classic, coverage or reservoir\n");
+			}
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			interval = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+			timeout = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-j") == 0) {
+			json = 1;
+		} else if (strcmp(argv[i], "-a") == 0) {
+			autosend = 1;
+		} else if (argv[i][0] != '-') {
+			port = argv[i];
+		} else {
+			die("Usage: imuread-headless [-r sample_rate] [-o oversample_ratio] "
+				"[-g novelty_uT] [-p policy] [-S seed]\n"
+				"  [-M metrics_file] [-t trace_file] [-w recording] [-P shm_name] [-n] "
+				"[-i secs] [-j] [-a] [-T secs] [port]\n");
+		}
+	}
+	if (!raw_data_set_rate(rate, ratio)) {
+		die("Sample rate must be positive, oversample ratio 1 to %d\n",
+			OVERSAMPLE_MAX);
+	}
+	if (novelty >= 0.0f) raw_data_set_novelty(novelty);
+	if (trace_start(trace)) atexit(write_trace);
+	if (recording_start(record)) atexit(recording_stop);
+	if (publish_start(publish)) atexit(publish_stop);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (!open_port(port)) die("Unable to open %s\n", port);
+	atexit(close_port);
+	if (resume) {
+		n = session_open(port);
+		if (n == SESSION_RESUMED && !json) printf("Resumed the saved session\n");
+		if (n == SESSION_WARM && !json) printf("Starting from this device's last calibration\n");
+		atexit(session_close);
+	}
+	stats_reset();
+	start = monotonic_ns();
+	next_status = start + (uint64_t)(interval * 1e9);
+	while (!stop) {
+		now = monotonic_ns();
+		if (timeout > 0.0f && now - start >= (uint64_t)(timeout * 1e9)) {
+			status = 2;
+			break;
+		}
+		// sleep until the port has data, the next status line or the poll
+		// interval the statistics and session saving need
+		wait_ms = 1000;
+		if (interval > 0.0f) {
+			wait_ms = (next_status > now) ? (int)((next_status - now) / 1000000) + 1 : 0;
+			if (wait_ms > 1000) wait_ms = 1000;
+		}
+		n = wait_serial_data(wait_ms);
+		if (n > 0 && read_serial_data() < 0) {
+			fprintf(stderr, "Error reading serial port\n");
+			status = 1;
+			break;
+		}
+		stats_poll();
+		session_poll();
+
+		magcal_sched_stats(&st);
+		if (st.samples != samples) {
+			samples = st.samples;
+			quality_refresh();
+			q[0] = quality_surface_gap_error();
+			q[1] = quality_magnitude_variance_error();
+			q[2] = quality_wobble_error();
+			q[3] = quality_spherical_fit_error();
+		}
+		now = monotonic_ns();
+		if (autosend && magcal.ValidMagCal && quality_ok(q) && !confirmed
+		  && (!sent || now - sent_ns >= (uint64_t)(CONFIRM_TIMEOUT_SECS * 1e9))) {
+			if (!sent) print_calibration();
+			send_calibration();
+			sent++;
+			sent_ns = now;
+		}
+		if (interval > 0.0f && now >= next_status) {
+			print_status((now - start) * 1e-9, q, sent);
+			next_status += (uint64_t)(interval * 1e9);
+			if (next_status < now) next_status = now + (uint64_t)(interval * 1e9);
+		}
+		if (autosend && confirmed) {
+			if (!json) printf("Calibration confirmed!\n");
+			break;
+		}
+	}
+	print_status((monotonic_ns() - start) * 1e-9, q, sent);
+	return status;
+}
@@ -0,0 +1,238 @@
+// Synthetic IMU stream generator
+//
+// Usage: imugen [options] > stream
+//
+//   -r rate       samples per second (default 100)
+//   -O ratio      check mode: gyro readings per orientation update
+//   -n count      number of samples (default 10 seconds worth)
+//   -t path       randomwalk, figure8, limited or still
+//   -w degrees    typical rotation speed, deg/s
+//   -l degrees    cone half angle for the limited trajectory
+//   -f format     ascii ("Raw:" lines, default), binary (0x7E packets) or
+//                 recording (the imuread -w session format)
+//   -V x,y,z      hard iron offset, uT
+//   -W a,b,c,d,e,f  symmetric soft iron matrix: xx,xy,xz,yy,yz,zz
+//   -d x,y,z      hard iron drift, uT per second
+//   -B field      geomagnetic field, uT
+//   -N noise      magnetometer noise, uT
+//   -o fraction   fraction of magnetometer outliers
+//   -S seed       random seed, for the sensor data and in check mode also
+//                 for the calibration's choices
+//   -P usec       check mode: schedule solves as if each took usec, rather
+//                 than by their measured cost, so runs are bit-reproducible
+//   -u jitter     append the sensor's microsecond clock to every sample,
+//                 with this sample interval std deviation (fraction of the
+//                 nominal interval, 0 for a steady clock)
+//   -g uT         check mode: novelty gate distance (default 1.0, 0 = off)
+//   -p policy     check mode: buffer retention policy
+//   -D id         check mode: warm start from the calibration cached for
+//                 device id, and cache the calibration found for it
+//   -c            check: feed the samples straight into raw_data() and
+//                 compare the calibration found against the ground truth
+//
+// The ground truth is written to stderr as JSON.  In check mode a JSON
+// result with the errors and the per sample CPU cost is written to stdout.
+
+#include "imuread.h"
+
+#define FORMAT_ASCII     0
+#define FORMAT_BINARY    1
+#define FORMAT_RECORDING 2
+
+static SynthConfig_t cfg;
+static int oversample = OVERSAMPLE_RATIO;
+static float novelty = -1.0f;
+static const char *device_id = NULL;
+
+void calibration_confirmed(void)
+{
+}
+
+static int parse_floats(const char *str, float *f, int n)
+{
+	char *end;
+	int i;
+
+	for (i=0; i < n; i++) {
+		f[i] = strtof(str, &end);
+		if (end == str) return 0;
+		str = end;
+		if (*str == ',') str++;
+	}
+	return 1;
+}
+
+static int parse_trajectory(const char *name)
+{
+	if (strcmp(name, "randomwalk") == 0) return SYNTH_RANDOMWALK;
+	if (strcmp(name, "figure8") == 0) return SYNTH_FIGURE8;
+	if (strcmp(name, "limited") == 0) return SYNTH_LIMITED;
+	if (strcmp(name, "still") == 0) return SYNTH_STILL;
+	return -1;
+}
+
+static void print_truth(FILE *fp)
+{
+	float V[3], invW[3][3], B;
+
+	synth_truth(V, invW, &B);
+	fprintf(fp, "{\"V\":[%.3f,%.3f,%.3f],\"invW\":[[%.5f,%.5f,%.5f],"
+		"[%.5f,%.5f,%.5f],[%.5f,%.5f,%.5f]],\"B\":%.3f}\n", V[0], V[1], V[2],
+		invW[0][0], invW[0][1], invW[0][2], invW[1][0], invW[1][1], invW[1][2],
+		invW[2][0], invW[2][1], invW[2][2], B);
+}
+
+static void generate(long count, int format)
+{
+	int16_t data[9];
+	char buf[160];
+	SampleTime_t time;
+	long i;
+	int n;
+
+	if (format == FORMAT_RECORDING) {
+		raw_data_set_rate(cfg.rate, oversample);
+		if (!recording_start("-")) exit(1);
+		memset(&time, 0, sizeof(time));
+	}
+	for (i=0; i < count; i++) {
+		synth_sample(data);
+		if (format == FORMAT_RECORDING) {
+			time.host_ns = (uint64_t)(i + 1) * (uint64_t)(1e9 / cfg.rate);
+			time.sensor_us = synth_time_us();
+			time.has_sensor_us = cfg.timestamps;
+			recording_sample(data, &time);
+			continue;
+		} else if (format == FORMAT_BINARY) {
+			n = synth_binary(data, i % MAGBUFFSIZE, (unsigned char *)buf);
+		} else {
+			n = synth_ascii(data, buf);
+		}
+		fwrite(buf, 1, n, stdout);
+	}
+	if (format == FORMAT_RECORDING) recording_stop();
+}
+
+static void check(long count)
+{
+	int16_t data[9];
+	float V[3], invW[3][3], B, dv, verr=0.0f, werr=0.0f;
+	MagCalSched_t stats;
+	SampleTime_t time;
+	uint32_t admitted, rejected;
+	uint64_t t0, ns=0;
+	long i;
+	int j, k;
+
+	memset(&time, 0, sizeof(time));
+	if (device_id) calcache_load(device_id);
+	for (i=0; i < count; i++) {
+		synth_sample(data);
+		time.sensor_us = synth_time_us();
+		time.has_sensor_us = cfg.timestamps;
+		t0 = monotonic_ns();
+		raw_data_timed(data, &time);
+		ns += monotonic_ns() - t0;
+	}
+	synth_truth(V, invW, &B);
+	for (j=0; j < 3; j++) {
+		dv = magcal.V[j] - V[j];
+		verr += dv * dv;
+		for (k=0; k < 3; k++) {
+			dv = fabsf(magcal.invW[j][k] - invW[j][k]);
+			if (dv > werr) werr = dv;
+		}
+	}
+	if (device_id) calcache_save(device_id);
+	magcal_sched_stats(&stats);
+	raw_data_novelty_stats(&admitted, &rejected);
+	printf("{\"samples\":%ld,\"rate\":%.0f,\"ns_per_sample\":%.0f,"
+		"\"cpu_load\":%.4f,\"solves\":%u,\"valid\":%d,\"fit_error\":%.2f,"
+		"\"V_error\":%.3f,\"invW_error\":%.5f,\"B_error\":%.3f,"
+		"\"first_valid\":%u,\"admitted\":%u,\"rejected\":%u}\n", count, cfg.rate, (double)ns / count,
+		(double)ns * 1e-9 / ((double)count / cfg.rate), stats.solves,
+		magcal.ValidMagCal, magcal.FitError, sqrtf(verr), werr,
+		fabsf(magcal.B - B), stats.first_valid, admitted, rejected);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: imugen [-r rate] [-O ratio] [-n count] [-t path] [-w deg/s] "
+		"[-l deg] [-f ascii|binary|recording]\n"
+		"  [-V x,y,z] [-W xx,xy,xz,yy,yz,zz] [-d x,y,z] [-B uT] [-N uT] "
+		"[-o fraction] [-S seed] [-P usec] [-u jitter] [-g uT] [-p policy]\n"
+		"  [-D device_id] [-c]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	float w[6];
+	long count=-1;
+	int i, format=FORMAT_ASCII, checkmode=0;
+
+	synth_default(&cfg);
+	for (i=1; i < argc; i++) {
+		if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0) usage();
+		if (argv[i][1] == 'c') {
+			checkmode = 1;
+			continue;
+		}
+		if (i + 1 >= argc) usage();
+		switch (argv[i][1]) {
+		  case 'r': cfg.rate = atof(argv[++i]); break;
+		  case 'n': count = atol(argv[++i]); break;
+		  case 'O': oversample = atoi(argv[++i]); break;
+		  case 't':
+			cfg.trajectory = parse_trajectory(argv[++i]);
+			if (cfg.trajectory < 0) usage();
+			break;
+		  case 'w': cfg.rotation = atof(argv[++i]); break;
+		  case 'l': cfg.coverage = atof(argv[++i]); break;
+		  case 'f':
+			i++;
+			if (strcmp(argv[i], "binary") == 0) format = FORMAT_BINARY;
+			else if (strcmp(argv[i], "ascii") == 0) format = FORMAT_ASCII;
+			else if (strcmp(argv[i], "recording") == 0) format = FORMAT_RECORDING;
+			else usage();
+			break;
+		  case 'V': if (!parse_floats(argv[++i], cfg.V, 3)) usage(); break;
+		  case 'W':
+			if (!parse_floats(argv[++i], w, 6)) usage();
+			cfg.W[0][0] = w[0];
+			cfg.W[0][1] = cfg.W[1][0] = w[1];
+			cfg.W[0][2] = cfg.W[2][0] = w[2];
+			cfg.W[1][1] = w[3];
+			cfg.W[1][2] = cfg.W[2][1] = w[4];
+			cfg.W[2][2] = w[5];
+			break;
+		  case 'd': if (!parse_floats(argv[++i], cfg.Vdrift, 3)) usage(); break;
+		  case 'B': cfg.B = atof(argv[++i]); break;
+		  case 'N': cfg.noise = atof(argv[++i]); break;
+		  case 'o': cfg.outliers = atof(argv[++i]); break;
+		  case 'S': cfg.seed = strtoull(argv[++i], NULL, 0); break;
+		  case 'g': novelty = atof(argv[++i]); break;
+		  case 'D': device_id = argv[++i]; break;
+		  case 'P': magcal_set_sched_cost(atof(argv[++i])); break;
+		  case 'p': if (!retention_set_policy(argv[++i])) usage(); break;
+		  case 'u':
+			cfg.timestamps = 1;
+			cfg.jitter = atof(argv[++i]);
+			break;
+		  default: usage();
+		}
+	}
+	if (cfg.rate <= 0.0f) usage();
+	if (checkmode && !raw_data_set_rate(cfg.rate, oversample)) usage();
+	if (checkmode && novelty >= 0.0f) raw_data_set_novelty(novelty);
+	if (checkmode) raw_data_set_seed(cfg.seed);
+	if (count < 0) count = (long)(cfg.rate * 10.0f);
+	synth_init(&cfg);
+	if (checkmode) {
+		check(count);
+	} else {
+		generate(count, format);
+	}
+	print_truth(stderr);
+	return 0;
+}
@@ -11,14 +11,24 @@ static void timer_callback(int val)
 
 	glutTimerFunc(TIMEOUT_MSEC, timer_callback, 0);
 	r = read_serial_data();
-	if (r < 0) die("Error reading %s\n", PORT);
+	if (r < 0) die("Error reading serial port\n");
+	stats_poll();
+	session_poll();
 	glutPostRedisplay(); // TODO: only redisplay if data changes
 }
 
 static void glut_display_callback(void)
 {
+	TRACE_BEGIN();
 	display_callback();
 	glutSwapBuffers();
+	stats_frame_shown(current_orientation_time.host_ns);
+	TRACE_END("paint", 0);
+}
+
+static void write_trace(void)
+{
+	if (trace_write(NULL)) printf("Trace written\n");
 }
 
 extern int invert_q0;
@@ -42,6 +52,78 @@ static void print_invert_state(void)
 	);
 }
 
+static void print_sched_stats(void)
+{
+	MagCalSched_t st;
+	uint32_t admitted, rejected;
+	float secs;
+
+	magcal_sched_stats(&st);
+	secs = (float)st.samples / raw_data_rate();
+	printf("Solver: %u solves (%.1f/s), %u accepted, %.1f us/solve, every %u sample%s\n",
+		st.solves, (secs > 0.0f) ? (float)st.solves / secs : 0.0f,
+		st.accepted, st.avg_solve_usec, st.min_gap, (st.min_gap == 1) ? "" : "s");
+	if (st.first_valid) {
+		printf("First valid calibration: sample %u (%.2f s sensor time, %.2f s wall)\n",
+			st.first_valid, (float)st.first_valid / raw_data_rate(),
+			st.first_valid_secs);
+	} else {
+		printf("First valid calibration: not yet\n");
+	}
+	raw_data_novelty_stats(&admitted, &rejected);
+	printf("Novelty gate: %.1f uT, %u admitted, %u rejected as redundant\n",
+		raw_data_get_novelty(), admitted, rejected);
+}
+
+static void print_jitter(const char *name, const SampleJitter_t *j)
+{
+	int i;
+
+	if (j->count == 0) {
+		printf("%s intervals: none\n", name);
+		return;
+	}
+	printf("%s intervals: %u, min %.0f us, max %.0f us, mean %.0f us, stddev %.0f us\n",
+		name, j->count, j->min_us, j->max_us, j->mean_us, j->stddev_us);
+	for (i=0; i < JITTER_BINS; i++) {
+		if (j->bins[i] == 0) continue;
+		printf("  %4.2f%s x nominal: %u\n", i * 0.25f,
+			(i == JITTER_BINS - 1) ? "+" : " ", j->bins[i]);
+	}
+}
+
+static void print_jitter_stats(void)
+{
+	SampleJitter_t sensor, host;
+
+	raw_data_jitter(&sensor, &host);
+	printf("Nominal interval: %.0f us\n", 1.0e6f / raw_data_rate());
+	print_jitter("Sensor", &sensor);
+	print_jitter("Host arrival", &host);
+}
+
+static void print_pipeline_stats(void)
+{
+	StageStats_t st;
+	double secs;
+	int i;
+
+	secs = stats_elapsed();
+	printf("Pipeline: %.0f bytes/s, %.1f samples/s over %.1f s\n",
+		secs > 0.0 ? stats_count(STAT_BYTES) / secs : 0.0,
+		secs > 0.0 ? stats_count(STAT_SAMPLES) / secs : 0.0, secs);
+	printf("  stage        calls    mean us   p50 us   p90 us   p99 us   max us\n");
+	for (i=0; i < STAT_PHOTON; i++) {
+		stats_stage(i, &st);
+		printf("  %-10s %7llu %10.2f %8.2f %8.2f %8.2f %8.2f\n", st.name,
+			(unsigned long long)st.calls, st.mean_ns * 0.001, st.p50_ns * 0.001,
+			st.p90_ns * 0.001, st.p99_ns * 0.001, st.max_ns * 0.001);
+	}
+	stats_stage(STAT_PHOTON, &st);
+	printf("Sensor to photon: %llu frames, p50 %.1f ms, p90 %.1f ms, "
+		"p99 %.1f ms, max %.1f ms\n", (unsigned long long)st.calls,
+		st.p50_ns * 1e-6, st.p90_ns * 1e-6, st.p99_ns * 1e-6, st.max_ns * 1e-6);
+}
 
 static void glut_keystroke_callback(unsigned char ch, int x, int y)
 {
@@ -80,6 +162,40 @@ static void glut_keystroke_callback(unsigned char ch, int x, int y)
 		print_invert_state();
 		return;
 	}
+	if (ch == 'm') {
+		magcal_set_multi(!magcal_get_multi());
+		printf("Multi-hypothesis calibration: %s\n",
+			magcal_get_multi() ? "on" : "off");
+		return;
+	}
+	if (ch == 'r') {
+		magcal_set_refine(!magcal_get_refine());
+		printf("Geometric refinement: %s\n",
+			magcal_get_refine() ? "on" : "off");
+		return;
+	}
+	if (ch == 'c') {
+		magcal_set_continuous((magcal_get_continuous() > 0.0f) ? 0.0f : 60.0f);
+		printf("Continuous calibration: %s\n",
+			(magcal_get_continuous() > 0.0f) ? "on, 60 s time constant" : "off");
+		return;
+	}
+	if (ch == 's') {
+		print_sched_stats();
+		return;
+	}
+	if (ch == 'j') {
+		print_jitter_stats();
+		return;
+	}
+	if (ch == 'i') {
+		print_pipeline_stats();
+		return;
+	}
+	if (ch == 't') {
+		write_trace();
+		return;
+	}
 
 
 	if (magcal.FitError > 9.0) {
@@ -104,9 +220,52 @@ void calibration_confirmed(void)
 
 int main(int argc, char *argv[])
 {
-	raw_data_reset();
+	const char *port = PORT, *trace = NULL, *record = NULL, *publish = NULL;
+	float rate = SENSORFS, novelty = -1.0f;
+	int i, n, ratio = OVERSAMPLE_RATIO, resume = 1;
 
 	glutInit(&argc, argv);
+	stats_set_dump_path(NULL);
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			ratio = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			novelty = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			trace = argv[++i];
+		} else if (strcmp(argv[i], "-n") == 0) {
+			resume = 0;
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			record = argv[++i];
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			publish = argv[++i];
+		} else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+			stats_set_dump_path(argv[++i]);
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			raw_data_set_seed(strtoull(argv[++i], NULL, 0));
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			if (!retention_set_policy(argv[++i])) {
+				die("Retention policy must be classic, coverage or reservoir\n");
+			}
+		} else if (argv[i][0] != '-') {
+			port = argv[i];
+		} else {
+			die("Usage: imuread [-r sample_rate] [-o oversample_ratio] "
+				"[-g novelty_uT] [-p policy] [-S seed] [-M metrics_file]\n"
+				"  [-t trace_file] [-w recording] [-P shm_name] [-n] [port]\n");
+		}
+	}
+	if (!raw_data_set_rate(rate, ratio)) {
+		die("Sample rate must be positive, oversample ratio 1 to %d\n",
+			OVERSAMPLE_MAX);
+	}
+	if (novelty >= 0.0f) raw_data_set_novelty(novelty);
+	if (trace_start(trace)) atexit(write_trace);
+	if (recording_start(record)) atexit(recording_stop);
+	if (publish_start(publish)) atexit(publish_stop);
+
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
 	glutInitWindowSize(600, 500);
 	glutCreateWindow("IMU Read");
@@ -118,7 +277,13 @@ int main(int argc, char *argv[])
 	glutTimerFunc(TIMEOUT_MSEC, timer_callback, 0);
 	glutKeyboardFunc(glut_keystroke_callback);
 
-	if (!open_port(PORT)) die("Unable to open %s\n", PORT);
+	if (!open_port(port)) die("Unable to open %s\n", port);
+	if (resume) {
+		n = session_open(port);
+		if (n == SESSION_RESUMED) printf("Resumed the saved session\n");
+		if (n == SESSION_WARM) printf("Starting from this device's last calibration\n");
+		atexit(session_close);
+	}
 	glutMainLoop();
 	close_port();
 	return 0;
@@ -15,19 +15,13 @@
 #if defined(LINUX)
   #include <termios.h>
   #include <unistd.h>
-  #include <GL/gl.h>  // sudo apt install mesa-common-dev
-  #include <GL/glu.h> // sudo apt install libglu1-mesa-dev freeglut3-dev
 #elif defined(WINDOWS)
   #include <windows.h>
-  #include <GL/gl.h>
-  #include <GL/glu.h>
-  #define random() rand()
 #elif defined(MACOSX)
   #include <termios.h>
   #include <unistd.h>
-  #include <OpenGL/gl.h>
-  #include <OpenGL/glu.h>
 #endif
+// OpenGL is included by visualize.c alone, so the rest builds without it
 
 
 #if defined(LINUX)
@@ -61,16 +55,55 @@ typedef struct {
 } Quaternion_t;
 extern Quaternion_t current_orientation;
 
+// when a sample was taken and received
+typedef struct {
+	uint64_t host_ns;            // host monotonic time the bytes were read, 0 = unknown
+	uint32_t sensor_us;          // sensor's microsecond clock, if sent
+	int8_t has_sensor_us;        // 1 = sensor_us is valid
+} SampleTime_t;
+extern SampleTime_t current_orientation_time;
+
+// inter-sample interval statistics, for judging the link quality
+#define JITTER_BINS 16           // intervals in steps of 1/4 nominal, last bin >= 3.75x
+typedef struct {
+	uint32_t count;              // intervals measured
+	uint32_t bins[JITTER_BINS];
+	float min_us;
+	float max_us;
+	float mean_us;
+	float stddev_us;
+} SampleJitter_t;
+
 extern int port_is_open(void);
 extern int open_port(const char *name);
 extern int read_serial_data(void);
+int wait_serial_data(int msec);
 extern int write_serial_data(const void *ptr, int len);
 extern void close_port(void);
+int port_device_id(const char *name, char *id, int len);
+extern uint64_t monotonic_ns(void);
+void newdata(const unsigned char *data, int len);
+void newdata_timed(const unsigned char *data, int len, uint64_t host_ns);
+void newdata_reset(void);
 void raw_data_reset(void);
 void cal1_data(const float *data);
 void cal2_data(const float *data);
 void calibration_confirmed(void);
 void raw_data(const int16_t *data);
+void raw_data_timed(const int16_t *data, const SampleTime_t *time);
+void raw_data_jitter(SampleJitter_t *sensor, SampleJitter_t *host);
+void raw_data_set_novelty(float ut);
+float raw_data_get_novelty(void);
+void raw_data_novelty_stats(uint32_t *admitted, uint32_t *rejected);
+int retention_set_policy(const char *name);
+const char * retention_policy_name(void);
+void retention_reset(void);
+int retention_choose(const int16_t *data);
+void retention_added(int slot);
+int raw_data_set_rate(float rate, int oversample);
+void raw_data_set_seed(uint64_t seed);
+float raw_data_rate(void);
+int raw_data_oversample(void);
 int send_calibration(void);
 void visualize_init(void);
 void apply_calibration(int16_t rawx, int16_t rawy, int16_t rawz, Point_t *out);
@@ -79,11 +112,87 @@ void resize_callback(int width, int height);
 int MagCal_Run(void);
 void quality_reset(void);
 void quality_update(const Point_t *point);
+void quality_refresh(void);
+int quality_sphere_region(const Point_t *point);
 float quality_surface_gap_error(void);
 float quality_magnitude_variance_error(void);
 float quality_wobble_error(void);
 float quality_spherical_fit_error(void);
 
+// pipeline instrumentation, compiled out of the hot path with -DNO_STATS
+#define STAT_READ      0    // serial port read() calls
+#define STAT_PARSE     1    // newdata(), both wire format parsers
+#define STAT_RAWDATA   2    // raw_data(), one sample
+#define STAT_ADDMAG    3    // add_magcal_data()
+#define STAT_EVICT     4    // retention policy choosing a slot to discard
+#define STAT_SOLVE     5    // MagCal_Run()
+#define STAT_FUSION    6    // fusion_update()
+#define STAT_DISPLAY   7    // display_callback()
+#define STAT_PHOTON    8    // newest sample's read() to its SwapBuffers()
+#define STAT_STAGES    9
+#define STAT_BYTES     0    // counters
+#define STAT_SAMPLES   1
+#define STAT_COUNTERS  2
+typedef struct {
+	const char *name;
+	uint64_t calls;
+	double mean_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+} StageStats_t;
+
+#ifndef NO_STATS
+extern int trace_enabled;
+void trace_begin(void);
+void trace_end(const char *name, int arg);
+#define TRACE_BEGIN()  do { if (trace_enabled) trace_begin(); } while (0)
+#define TRACE_END(name, arg) do { if (trace_enabled) trace_end(name, arg); } while (0)
+extern uint64_t stats_start[STAT_STAGES];
+extern uint64_t stats_counter[STAT_COUNTERS];
+void stats_record(int stage, uint64_t ns);
+#define STAT_BEGIN(stage)  (stats_start[stage] = monotonic_ns())
+#define STAT_END(stage)    stats_record(stage, monotonic_ns() - stats_start[stage])
+#define STAT_ADD(counter, n) (stats_counter[counter] += (n))
+#else
+#define TRACE_BEGIN()  ((void)0)
+#define TRACE_END(name, arg) ((void)(name), (void)(arg))
+#define STAT_BEGIN(stage)  ((void)0)
+#define STAT_END(stage)    ((void)0)
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+void stats_reset(void);
+void stats_stage(int stage, StageStats_t *out);
+uint64_t stats_count(int counter);
+double stats_elapsed(void);
+int stats_dump(const char *path);
+void stats_set_dump_path(const char *path);
+void stats_poll(void);
+void stats_frame_shown(uint64_t sample_ns);
+int trace_start(const char *path);
+void trace_thread_name(const char *name);
+int trace_write(const char *path);
+
+#define MINBFITUT 22.0F       // minimum geomagnetic field B (uT) for valid calibration
+#define MAXBFITUT 67.0F       // maximum geomagnetic field B (uT) for valid calibration
+
+// all 4 quality metrics must be below these to enable "Send Cal"
+#define QUALITY_GAPS_OK      15.0f
+#define QUALITY_VARIANCE_OK   4.5f
+#define QUALITY_WOBBLE_OK     4.0f
+#define QUALITY_FITERROR_OK   5.0f
+
+// small fast random number generator, one per calibration session
+typedef struct {
+	uint32_t s[4];               // xoshiro128** state
+} Prng_t;
+
+void prng_seed(Prng_t *rng, uint64_t seed);
+uint32_t prng_next(Prng_t *rng);
+uint32_t prng_below(Prng_t *rng, uint32_t n);
+float prng_uniform(Prng_t *rng);
+
 // magnetic calibration & buffer structure
 typedef struct {
     float V[3];                  // current hard iron offset x, y, z, (uT)
@@ -103,13 +212,85 @@ typedef struct {
     float vecA[10];              // scratch 10x1 vector used by calibration algorithms
     float vecB[4];               // scratch 4x1 vector used by calibration algorithms
     int8_t ValidMagCal;          // integer value 0, 4, 7, 10 denoting both valid calibration and solver used
+    int8_t EigSweeps;            // Jacobi sweeps used by the last eigenpair solve
     int16_t BpFast[3][MAGBUFFSIZE];   // uncalibrated magnetometer readings
     int8_t  valid[MAGBUFFSIZE];        // 1=has data, 0=empty slot
     int16_t MagBufferCount;           // number of magnetometer readings
+    Prng_t rng;                       // eviction choices, seeded at reset
 } MagCalibration_t;
 
 extern MagCalibration_t magcal;
 
+// a calibration and the buffer it was solved from, to restart from
+typedef struct {
+	float V[3];
+	float invW[3][3];
+	float B;
+	float FitError;
+	int8_t ValidMagCal;
+	int16_t BpFast[3][MAGBUFFSIZE];
+	int8_t valid[MAGBUFFSIZE];
+} MagCalSnapshot_t;
+
+void raw_data_snapshot(MagCalSnapshot_t *snap);
+void raw_data_restore(const MagCalSnapshot_t *snap);
+void magcal_warm_start(const MagCalSnapshot_t *cal);
+void magcal_verify_restored(void);
+int magcal_restore_pending(void);
+void magcal_warm_reading(int16_t x, int16_t y, int16_t z);
+#define SESSION_NONE    0    // session_open() found nothing to start from
+#define SESSION_WARM    1    // the device's last calibration, buffer empty
+#define SESSION_RESUMED 2    // the whole session, calibration and buffer
+int session_open(const char *port);
+void session_poll(void);
+void session_close(void);
+int calcache_load(const char *id);
+int calcache_save(const char *id);
+
+// magnetic calibration solver scheduling statistics
+typedef struct {
+	uint32_t samples;            // samples seen since reset
+	uint32_t solves;             // solver invocations since reset
+	uint32_t accepted;           // solutions accepted since reset
+	uint32_t first_valid;        // sample number of first accepted calibration, 0 = none yet
+	uint32_t min_gap;            // minimum samples between solves (1 = every sample)
+	float avg_solve_usec;        // smoothed solver cost
+	double solve_secs;           // total time spent in the solvers
+	double first_valid_secs;     // wall time from reset to first accepted calibration
+	uint32_t refine_iterations;  // Levenberg-Marquardt refinement iterations
+	double refine_secs;          // total time spent in refinement
+} MagCalSched_t;
+
+void magcal_sched_reset(void);
+void magcal_sched_changed(int slot, int evicted);
+void magcal_sched_stats(MagCalSched_t *stats);
+uint32_t magcal_generation(void);
+void magcal_set_multi(int enable);
+int magcal_get_multi(void);
+void magcal_set_refine(int enable);
+int magcal_get_refine(void);
+void magcal_set_sched_cost(float usec);
+
+// mergeable calibration sums, for calibrating from any number of samples
+#define MAGACCUM_MOMENTS 35
+#define MAGACCUM_SERIAL_SIZE (4 + 8 * (4 + MAGACCUM_MOMENTS))
+typedef struct {
+	double count;                     // number (or total weight) of samples
+	double offset[3];                 // reference point of the moments (counts)
+	double moment[MAGACCUM_MOMENTS];  // sums of x^i.y^j.z^k, i+j+k <= 4
+} MagCalAccum_t;
+
+void magcal_accum_init(MagCalAccum_t *acc);
+void magcal_accum_add(MagCalAccum_t *acc, int16_t rawx, int16_t rawy, int16_t rawz);
+void magcal_accum_decay(MagCalAccum_t *acc, double factor);
+void magcal_accum_merge(MagCalAccum_t *dst, const MagCalAccum_t *src);
+int magcal_accum_serialize(const MagCalAccum_t *acc, uint8_t *buf, int len);
+int magcal_accum_deserialize(MagCalAccum_t *acc, const uint8_t *buf, int len);
+int magcal_accum_solve(const MagCalAccum_t *acc, MagCalibration_t *MagCal);
+void magcal_set_continuous(float tau);
+float magcal_get_continuous(void);
+void magcal_continuous_add(int16_t rawx, int16_t rawy, int16_t rawz);
+
 
 void f3x3matrixAeqI(float A[][3]);
 void fmatrixAeqI(float *A[], int16_t rc);
@@ -118,13 +299,18 @@ void f3x3matrixAeqInvSymB(float A[][3], float B[][3]);
 void f3x3matrixAeqAxScalar(float A[][3], float Scalar);
 void f3x3matrixAeqMinusA(float A[][3]);
 float f3x3matrixDetA(float A[][3]);
-void eigencompute(float A[][10], float eigval[], float eigvec[][10], int8_t n);
+int eigencompute(float A[][10], float eigval[], float eigvec[][10], int8_t n);
 void fmatrixAeqInvA(float *A[], int8_t iColInd[], int8_t iRowInd[], int8_t iPivot[], int8_t isize);
 void fmatrixAeqRenormRotA(float A[][3]);
+void fUpdateCalibration4INV(MagCalibration_t *MagCal);
+void fUpdateCalibration7EIG(MagCalibration_t *MagCal);
+void fUpdateCalibration10EIG(MagCalibration_t *MagCal);
+int fRefineCalibrationLM(MagCalibration_t *MagCal, uint64_t budget_ns);
 
 
-#define SENSORFS 100
-#define OVERSAMPLE_RATIO 4
+#define SENSORFS 100          // default sample rate (Hz)
+#define OVERSAMPLE_RATIO 4    // default gyro readings per orientation update
+#define OVERSAMPLE_MAX 32
 
 
 // accelerometer sensor structure definition
@@ -148,7 +334,8 @@ typedef struct
 typedef struct
 {
 	float Yp[3];                           // raw gyro sensor output (deg/s)
-	float YpFast[OVERSAMPLE_RATIO][3];     // fast (typically 200Hz) readings
+	float YpFast[OVERSAMPLE_MAX][3];       // fast (typically 200Hz) readings
+	float dtFast[OVERSAMPLE_MAX];          // interval ending at each fast reading (s)
 } GyroSensor_t;
 
 
@@ -160,6 +347,114 @@ void fusion_update(const AccelSensor_t *Accel, const MagSensor_t *Mag, const Gyr
     const MagCalibration_t *MagCal);
 void fusion_read(Quaternion_t *q);
 
+// synthetic sensor data with known calibration, for load and accuracy tests
+#define SYNTH_RANDOMWALK 0   // tumbling in every direction
+#define SYNTH_FIGURE8    1   // operator waving the sensor in a figure-8
+#define SYNTH_LIMITED    2   // random walk held within a cone of tilt
+#define SYNTH_STILL      3   // resting on a table
+typedef struct {
+	float rate;            // samples per second
+	int trajectory;        // SYNTH_* rotation pattern
+	float rotation;        // typical rotation speed (deg/s)
+	float coverage;        // SYNTH_LIMITED cone half angle (deg)
+	float V[3];            // true hard iron offset (uT)
+	float Vdrift[3];       // hard iron change per second (uT/s)
+	float W[3][3];         // true soft iron matrix, invW is its inverse
+	float B;               // geomagnetic field magnitude (uT)
+	float inclination;     // geomagnetic field dip angle (deg)
+	float noise;           // magnetometer noise std deviation (uT)
+	float outliers;        // fraction of magnetometer readings replaced by junk
+	float jitter;          // sample interval std deviation, fraction of nominal
+	int timestamps;        // 1 = append the sensor microsecond clock
+	uint64_t seed;
+} SynthConfig_t;
+
+void synth_default(SynthConfig_t *cfg);
+void synth_init(const SynthConfig_t *cfg);
+void synth_sample(int16_t *data);
+void synth_orientation(Quaternion_t *q);
+uint32_t synth_time_us(void);
+void synth_truth(float V[3], float invW[3][3], float *B);
+int synth_ascii(const int16_t *data, char *buf);
+int synth_binary(const int16_t *data, int id, unsigned char *buf);
+
+// session recordings, in delta coded blocks with an index, see recording.c
+#define REC_SAMPLE    0
+#define REC_ACCEPT    1    // MagCal_Run() accepted a new calibration
+#define REC_SENDCAL   2    // the calibration was sent to the sensor
+#define REC_CONFIRM   3    // the sensor echoed Cal1 (which = 1) or Cal2 (2)
+#define REC_SNAPSHOT  4    // calibration buffer, at the start of each block
+typedef struct {
+	int type;                    // REC_*
+	uint32_t sample;             // samples before this record
+	int16_t data[9];             // REC_SAMPLE
+	SampleTime_t time;           // REC_SAMPLE
+	int has_time;                // 0 = recorded without a SampleTime_t
+	int which;                   // REC_CONFIRM
+	MagCalSnapshot_t cal;        // the others, buffer only for REC_SNAPSHOT
+} RecRecord_t;
+
+typedef struct {
+	const uint8_t *base;         // the whole file, mapped
+	size_t size;
+	const uint8_t *index;        // NULL = recording cut short, no index
+	uint32_t nblocks;
+	uint32_t block_size;
+	float rate;                  // sample rate and oversample ratio recorded
+	int oversample;
+	uint32_t block;              // decoder position
+	const uint8_t *p, *end;
+	uint32_t records;            // records left in the block
+	uint32_t sample;
+	int16_t prev[9];
+	uint64_t host_ns;
+	uint32_t sensor_us;
+} RecReader_t;
+
+int recording_start(const char *path);
+int recording_active(void);
+void recording_sample(const int16_t *data, const SampleTime_t *time);
+void recording_event(int type, int which);
+void recording_stop(void);
+int recording_open(RecReader_t *r, const char *path);
+uint32_t recording_seek(RecReader_t *r, double secs);
+int recording_next(RecReader_t *r, RecRecord_t *rec);
+void recording_close(RecReader_t *r);
+
+// live output of every sample to other processes, in a shared memory ring,
+// see publish.c
+#define PUBLISH_LOST     -1    // publish_next() found its record overwritten
+#define PUBLISH_CLOSED   -2    // the writer has stopped
+typedef struct {
+	uint64_t sample;             // records published before this one
+	uint64_t host_ns;            // host monotonic time the sample was read
+	uint32_t sensor_us;
+	uint32_t has_sensor_us;
+	uint32_t generation;         // changes whenever the calibration does
+	float mag[3];                // calibrated, uT
+	float accel[3];              // g
+	float gyro[3];               // deg/sec
+	Quaternion_t q;              // orientation as of this sample
+} PublishRecord_t;
+
+typedef struct {
+	void *base;                  // the ring, mapped read only
+	float rate;                  // the writer's sample rate and oversample ratio
+	int oversample;
+	uint32_t pid;                // the writer's process
+	uint64_t next;               // record to read next
+	uint64_t lost;               // records overwritten before they were read
+} PublishReader_t;
+
+int publish_start(const char *name);
+int publish_active(void);
+void publish_sample(const int16_t *data, const SampleTime_t *time,
+	const Point_t *mag, uint32_t generation);
+void publish_stop(void);
+int publish_open(PublishReader_t *r, const char *name);
+int publish_next(PublishReader_t *r, PublishRecord_t *rec);
+void publish_close(PublishReader_t *r);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
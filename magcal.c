@@ -44,27 +44,633 @@
 #define MINMEASUREMENTS4CAL 40      // minimum number of measurements for 4 element calibration
 #define MINMEASUREMENTS7CAL 100     // minimum number of measurements for 7 element calibration
 #define MINMEASUREMENTS10CAL 150    // minimum number of measurements for 10 element calibration
-#define MINBFITUT 22.0F             // minimum geomagnetic field B (uT) for valid calibration
-#define MAXBFITUT 67.0F             // maximum geomagnetic field B (uT) for valid calibration
 #define FITERRORAGINGSECS 7200.0F   // 2 hours: time for fit error to increase (age) by e=2.718
+#define LMITERATIONS 8              // maximum Levenberg-Marquardt iterations
+#define LMBUDGETNS 2000000          // Levenberg-Marquardt time budget per solve (2 ms)
+#define LMLAMBDAINIT 0.001F         // initial Levenberg-Marquardt damping
 
-static void fUpdateCalibration4INV(MagCalibration_t *MagCal);
-static void fUpdateCalibration7EIG(MagCalibration_t *MagCal);
-static void fUpdateCalibration10EIG(MagCalibration_t *MagCal);
+static void fSolveCalibration10EIG(MagCalibration_t *MagCal, float fCount, const float fOffset[3]);
+static int moment_index(int i, int j, int k);
 
+MagCalibration_t magcal;
 
 
+void apply_calibration(int16_t rawx, int16_t rawy, int16_t rawz, Point_t *out)
+{
+	float x, y, z;
+
+	x = ((float)rawx * UT_PER_COUNT) - magcal.V[0];
+	y = ((float)rawy * UT_PER_COUNT) - magcal.V[1];
+	z = ((float)rawz * UT_PER_COUNT) - magcal.V[2];
+	out->x = x * magcal.invW[0][0] + y * magcal.invW[0][1] + z * magcal.invW[0][2];
+	out->y = x * magcal.invW[1][0] + y * magcal.invW[1][1] + z * magcal.invW[1][2];
+	out->z = x * magcal.invW[2][0] + y * magcal.invW[2][1] + z * magcal.invW[2][2];
+}
+
+
+
+// solver scheduling: rather than solving on a fixed 1-in-20 count, every
+// change to the buffer adds to a score, and the solver runs once enough has
+// changed.  The measured solver cost sets how often we're allowed to solve,
+// so when solving is cheap relative to the sample period it runs on every
+// sample which changes the buffer.
+#define SCHEDSCOREINSERT 1          // score for a point added to an empty slot
+#define SCHEDSCOREREPLACE 1         // score for a point replacing an evicted one
+#define SCHEDSCOREREGION 8          // score for a point in a previously empty sphere region
+#define SCHEDSCORETRIGGER 20        // score needed to run the solver
+#define SCHEDMAXSECS 2.0F           // solve at least this often while the buffer changes
+#define SCHEDCPUBUDGET 0.10F        // max fraction of the sample period spent solving
+#define FITERRORAGEPERSEC 1.104F    // FitErrorAge growth per second (was 1.02 per 20 samples at 100 Hz)
+
+static struct {
+	uint32_t samples;           // samples seen since reset
+	uint32_t since;             // samples since the last solve
+	uint32_t score;             // accumulated buffer change since the last solve
+	uint32_t solves;            // solver invocations since reset
+	uint32_t accepted;          // solutions accepted since reset
+	uint32_t first_valid;       // sample number of first accepted calibration, 0 = none
+	uint32_t min_gap;           // minimum samples between solves, from solver cost
+	uint64_t reset_ns;          // time of reset
+	uint64_t first_valid_ns;    // time of first accepted calibration
+	uint64_t solve_ns;          // total time spent solving
+	float avg_solve_ns;         // smoothed solver cost
+	uint32_t refine_iterations; // Levenberg-Marquardt iterations run
+	uint64_t refine_ns;         // total time spent refining
+	uint8_t region_seen[100];   // sphere regions which have held a point
+} sched;
+
+static uint32_t generation=0;      // bumped whenever the calibration changes, never reset
+
+static int refine_enabled=0;
+static float pinned_solve_ns=0.0f;  // fixed solver cost for the scheduler, 0 = measure
+
+#define WARMREADINGS 20             // new readings needed to check a warm start
+#define WARMREGIONS 4               // ... in at least this many sphere regions
+#define WARMMAXERRPC 3.0F           // ... with rms field magnitude error below this %
+static int8_t warm_pending=0;       // 1 = a warm start or restored calibration awaits the check
+static int8_t warm_solver=0;        // its solver, 0 = none
+static int8_t warm_restored=0;      // 1 = restored with the buffer, see magcal_verify_restored
+static float warm_fit;              // its fit error %
+static int warm_readings, warm_regions;
+static float warm_sumsq;            // sum of squared field magnitude errors
+static uint8_t warm_seen[100];      // sphere regions the new readings fall in
+static uint8_t warm_new[MAGBUFFSIZE];  // slot written since the restore
+
+void magcal_set_refine(int enable)
+{
+	refine_enabled = enable;
+}
+
+int magcal_get_refine(void)
+{
+	return refine_enabled;
+}
+
+// The scheduler normally spaces solves by their measured cost, which
+// varies from run to run.  A fixed cost makes it solve at the same
+// samples every time, and lets refinement run to convergence rather
+// than to a time budget, so seeded replays are bit-reproducible.
+void magcal_set_sched_cost(float usec)
+{
+	pinned_solve_ns = (usec > 0.0f) ? usec * 1000.0f : 0.0f;
+}
+
+void magcal_sched_reset(void)
+{
+	memset(&sched, 0, sizeof(sched));
+	sched.min_gap = 1;
+	sched.reset_ns = monotonic_ns();
+	warm_pending = 0;
+	warm_restored = 0;
+	generation++;
+	// drop the last stream's decayed sums, and rederive the decay, which
+	// depends on the sample rate
+	magcal_set_continuous(magcal_get_continuous());
+}
+
+static void warm_begin(int solver, float fit, int restored)
+{
+	warm_pending = 1;
+	warm_solver = solver;
+	warm_fit = fit;
+	warm_restored = restored;
+	warm_readings = 0;
+	warm_regions = 0;
+	warm_sumsq = 0.0f;
+	memset(warm_seen, 0, sizeof(warm_seen));
+	memset(warm_new, 0, sizeof(warm_new));
+}
+
+// Warm start, after a reset, from the calibration this device had last
+// time.  It replaces the default initial guess at once, so the quality
+// metrics and the retention policy judge the first readings with it, and
+// becomes the valid calibration as soon as enough new readings, spread
+// over enough of the sphere, agree with its field strength.  If they
+// don't, the sensor has changed and the solvers start as usual.
+void magcal_warm_start(const MagCalSnapshot_t *cal)
+{
+	int i, j;
+
+	for (i = X; i <= Z; i++) {
+		magcal.V[i] = cal->V[i];
+		for (j = X; j <= Z; j++) {
+			magcal.invW[i][j] = cal->invW[i][j];
+		}
+	}
+	magcal.B = cal->B;
+	magcal.FourBsq = 4.0F * cal->B * cal->B;
+	warm_begin(cal->ValidMagCal, cal->FitError, 0);
+	generation++;
+}
+
+// A restored session may not be this sensor's: the session is keyed by
+// the port name where the device has no serial number, so another board
+// on the same port finds it.  Its buffer is kept, but its calibration
+// is only a warm start until new readings agree with it, and the solvers
+// wait for the verdict.  If the readings disagree, the restored readings
+// are dropped too.  Call right after raw_data_restore().
+void magcal_verify_restored(void)
+{
+	warm_begin(magcal.ValidMagCal, magcal.FitError, 1);
+	magcal.ValidMagCal = 0;
+	magcal.FitError = 100.0f;
+	magcal.FitErrorAge = 100.0f;
+	generation++;
+}
+
+// 1 while a restored calibration waits for new readings to confirm it
+int magcal_restore_pending(void)
+{
+	return warm_pending && warm_restored;
+}
+
+// every reading offered to the buffer, before the novelty gate: a
+// matching sensor's readings are mostly near restored ones
+void magcal_warm_reading(int16_t x, int16_t y, int16_t z)
+{
+	Point_t point;
+	float field;
+	int region;
+
+	if (!warm_pending) return;
+	apply_calibration(x, y, z, &point);
+	field = sqrtf(point.x * point.x + point.y * point.y + point.z * point.z);
+	warm_sumsq += (field - magcal.B) * (field - magcal.B);
+	region = quality_sphere_region(&point);
+	if (!warm_seen[region]) {
+		warm_seen[region] = 1;
+		warm_regions++;
+	}
+	warm_readings++;
+}
+
+static void warm_check(void)
+{
+	float errpc;
+	int i;
+
+	if (warm_readings < WARMREADINGS || warm_regions < WARMREGIONS) return;
+	errpc = sqrtf(warm_sumsq / (float)warm_readings) * 100.0F / magcal.B;
+	if (errpc > WARMMAXERRPC && warm_restored) {
+		// another sensor, whose readings would only spoil the fit
+		for (i=0; i < MAGBUFFSIZE; i++) {
+			if (magcal.valid[i] && !warm_new[i]) magcal.valid[i] = 0;
+		}
+	} else if (errpc <= WARMMAXERRPC && warm_solver) {
+		sched.first_valid = sched.samples;
+		sched.first_valid_ns = monotonic_ns();
+		sched.accepted++;
+		generation++;
+		magcal.ValidMagCal = warm_solver;
+		magcal.FitError = (warm_fit > errpc) ? warm_fit : errpc;
+		magcal.FitErrorAge = (magcal.FitError > 2.0f) ? magcal.FitError : 2.0f;
+		recording_event(REC_ACCEPT, 0);
+	}
+	warm_pending = 0;
+	warm_restored = 0;
+}
+
+// called when buffer slot has been written with a new point
+void magcal_sched_changed(int slot, int evicted)
+{
+	Point_t point;
+	int region;
+
+	sched.score += evicted ? SCHEDSCOREREPLACE : SCHEDSCOREINSERT;
+	if (warm_restored) warm_new[slot] = 1;
+	apply_calibration(magcal.BpFast[0][slot], magcal.BpFast[1][slot],
+		magcal.BpFast[2][slot], &point);
+	region = quality_sphere_region(&point);
+	if (!sched.region_seen[region]) {
+		sched.region_seen[region] = 1;
+		sched.score += SCHEDSCOREREGION;
+	}
+}
+
+// tells readers of the published samples which calibration they carry
+uint32_t magcal_generation(void)
+{
+	return generation;
+}
+
+void magcal_sched_stats(MagCalSched_t *stats)
+{
+	stats->samples = sched.samples;
+	stats->solves = sched.solves;
+	stats->accepted = sched.accepted;
+	stats->first_valid = sched.first_valid;
+	stats->min_gap = sched.min_gap;
+	stats->avg_solve_usec = sched.avg_solve_ns * 0.001f;
+	stats->solve_secs = (double)sched.solve_ns * 1e-9;
+	stats->first_valid_secs = sched.first_valid ?
+		(double)(sched.first_valid_ns - sched.reset_ns) * 1e-9 : 0.0;
+	stats->refine_iterations = sched.refine_iterations;
+	stats->refine_secs = (double)sched.refine_ns * 1e-9;
+}
+
+static int sched_due(void)
+{
+	if (sched.score == 0) return 0;
+	if (sched.since < sched.min_gap) return 0;
+	// solving is cheap enough to keep up with every sample
+	if (sched.min_gap <= 1) return 1;
+	if (sched.score >= SCHEDSCORETRIGGER) return 1;
+	if (sched.since >= (uint32_t)(SCHEDMAXSECS * raw_data_rate())) return 1;
+	return 0;
+}
+
+static void sched_solved(uint64_t ns)
+{
+	float gap;
+
+	sched.solves++;
+	sched.solve_ns += ns;
+	if (pinned_solve_ns > 0.0f) {
+		sched.avg_solve_ns = pinned_solve_ns;
+	} else if (sched.avg_solve_ns == 0.0f) {
+		sched.avg_solve_ns = (float)ns;
+	} else {
+		sched.avg_solve_ns += ((float)ns - sched.avg_solve_ns) * 0.1f;
+	}
+	// never spend more than SCHEDCPUBUDGET of the sensor's time solving
+	gap = sched.avg_solve_ns * 1e-9f * raw_data_rate() / SCHEDCPUBUDGET;
+	sched.min_gap = (gap < 1.0f) ? 1 : (uint32_t)ceilf(gap);
+	sched.since = 0;
+	sched.score = 0;
+}
+
+// multi-hypothesis mode: instead of picking one solver from the point count,
+// run the 4, 7 and 10 element solvers plus an outlier-trimmed 10 element
+// solver concurrently on the same snapshot of the buffer, with 1 in every
+// MULTIHOLDOUT points held out of the fit.  The solver which best predicts
+// the held out points wins and is refit using all the points.
+#define MULTIHYPOTHESES 4           // number of candidate solvers
+#define MULTIHOLDOUT 5              // hold out 1 of every 5 points for validation
+#define MULTITRIM 0.10F             // fraction of worst fitting points trimmed
+#define MULTIMINFIT 20              // minimum points to fit when holding out
+
+static int multi_enabled=0;
+static MagCalibration_t hypothesis[MULTIHYPOTHESES];
+static int16_t heldout[MAGBUFFSIZE];
+static int heldout_count;
+
+void magcal_set_multi(int enable)
+{
+	multi_enabled = enable;
+}
+
+int magcal_get_multi(void)
+{
+	return multi_enabled;
+}
+
+// calibrated field magnitude error (%) of a raw point using the trial calibration
+static float trial_error_pc(const MagCalibration_t *MagCal, int n)
+{
+	float x, y, z, cx, cy, cz;
+
+	x = (float)MagCal->BpFast[X][n] * FXOS8700_UTPERCOUNT - MagCal->trV[X];
+	y = (float)MagCal->BpFast[Y][n] * FXOS8700_UTPERCOUNT - MagCal->trV[Y];
+	z = (float)MagCal->BpFast[Z][n] * FXOS8700_UTPERCOUNT - MagCal->trV[Z];
+	cx = MagCal->trinvW[X][X] * x + MagCal->trinvW[X][Y] * y + MagCal->trinvW[X][Z] * z;
+	cy = MagCal->trinvW[Y][X] * x + MagCal->trinvW[Y][Y] * y + MagCal->trinvW[Y][Z] * z;
+	cz = MagCal->trinvW[Z][X] * x + MagCal->trinvW[Z][Y] * y + MagCal->trinvW[Z][Z] * z;
+	return (sqrtf(cx * cx + cy * cy + cz * cz) - MagCal->trB) * 100.0F / MagCal->trB;
+}
+
+// returns the smallest of the largest MULTITRIM fraction of the n errors,
+// so errors at or above the limit are the outliers to be trimmed.  The
+// order of err[] is changed.
+static float trim_limit(float err[], int n)
+{
+	float ftmp;
+	int i, k, kmax, j;
+
+	j = (int)((float)n * MULTITRIM);
+	if (j < 1) return 1e30f;
+	// partial selection sort, only the largest j errors matter
+	for (i=0; i < j; i++) {
+		kmax = i;
+		for (k=i+1; k < n; k++) {
+			if (err[k] > err[kmax]) kmax = k;
+		}
+		ftmp = err[i];
+		err[i] = err[kmax];
+		err[kmax] = ftmp;
+	}
+	return err[j - 1];
+}
+
+// 10 element calibration, refit after discarding the worst fitting points
+static void fUpdateCalibration10EIGTrim(MagCalibration_t *MagCal)
+{
+	float err[MAGBUFFSIZE], sorted[MAGBUFFSIZE], limit;
+	int i, n=0;
+
+	fUpdateCalibration10EIG(MagCal);
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (MagCal->valid[i]) {
+			err[i] = fabsf(trial_error_pc(MagCal, i));
+			sorted[n++] = err[i];
+		}
+	}
+	if (n < MINMEASUREMENTS4CAL) return;
+	limit = trim_limit(sorted, n);
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (MagCal->valid[i] && err[i] >= limit) MagCal->valid[i] = 0;
+	}
+	fUpdateCalibration10EIG(MagCal);
+}
+
+static void solve_hypothesis(int n)
+{
+	TRACE_BEGIN();
+	switch (n) {
+	case 0:
+		fUpdateCalibration4INV(&hypothesis[0]);
+		if (hypothesis[0].trFitErrorpc < 12.0f) hypothesis[0].trFitErrorpc = 12.0f;
+		break;
+	case 1:
+		fUpdateCalibration7EIG(&hypothesis[1]);
+		if (hypothesis[1].trFitErrorpc < 7.5f) hypothesis[1].trFitErrorpc = 7.5f;
+		break;
+	case 2:
+		fUpdateCalibration10EIG(&hypothesis[2]);
+		break;
+	case 3:
+		fUpdateCalibration10EIGTrim(&hypothesis[3]);
+		break;
+	}
+	TRACE_END("hypothesis", n);
+}
+
+#if defined(LINUX) || defined(MACOSX)
+#include <pthread.h>
+
+// small fixed pool: worker n always solves hypothesis n, while the
+// calling thread solves hypothesis 0
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned int pool_generation=0;
+static int pool_pending=0;
+static int pool_started=0;
+
+static void * pool_worker(void *arg)
+{
+	int n = (int)(intptr_t)arg;
+	unsigned int seen=0;
+
+	trace_thread_name("solver pool");
+	pthread_mutex_lock(&pool_lock);
+	while (1) {
+		while (pool_generation == seen) {
+			pthread_cond_wait(&pool_work, &pool_lock);
+		}
+		seen = pool_generation;
+		pthread_mutex_unlock(&pool_lock);
+		solve_hypothesis(n);
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_pending == 0) pthread_cond_signal(&pool_done);
+	}
+	return NULL;
+}
+
+static void solve_all_hypotheses(void)
+{
+	pthread_t thread;
+	int i;
+
+	if (!pool_started) {
+		for (i=1; i < MULTIHYPOTHESES; i++) {
+			if (pthread_create(&thread, NULL, pool_worker, (void *)(intptr_t)i) != 0) break;
+			pthread_detach(thread);
+		}
+		pool_started = i;
+	}
+	pthread_mutex_lock(&pool_lock);
+	pool_pending = pool_started - 1;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	solve_hypothesis(0);
+	// any hypotheses without a worker thread are solved here
+	for (i=pool_started; i < MULTIHYPOTHESES; i++) {
+		solve_hypothesis(i);
+	}
+	pthread_mutex_lock(&pool_lock);
+	while (pool_pending > 0) {
+		pthread_cond_wait(&pool_done, &pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+static void solve_all_hypotheses(void)
+{
+	int i;
+
+	for (i=0; i < MULTIHYPOTHESES; i++) {
+		solve_hypothesis(i);
+	}
+}
+
+#endif
+
+// returns the solver used (4, 7 or 10) with its trial solution in magcal, or 0
+static int multi_solve(int count)
+{
+	static const int8_t solver[MULTIHYPOTHESES] = {4, 7, 10, 10};
+	float err[MAGBUFFSIZE], limit, sum, score, best=1e30f;
+	int i, n, used, ibest=-1;
+
+	// snapshot the buffer, holding out every MULTIHOLDOUT'th point
+	memcpy(&hypothesis[0], &magcal, sizeof(MagCalibration_t));
+	heldout_count = 0;
+	if (count - count / MULTIHOLDOUT >= MULTIMINFIT) {
+		for (i=0, n=0; i < MAGBUFFSIZE; i++) {
+			if (!hypothesis[0].valid[i]) continue;
+			if (++n % MULTIHOLDOUT == 0) {
+				hypothesis[0].valid[i] = 0;
+				heldout[heldout_count++] = i;
+			}
+		}
+	}
+	for (i=1; i < MULTIHYPOTHESES; i++) {
+		memcpy(&hypothesis[i], &hypothesis[0], sizeof(MagCalibration_t));
+	}
+	solve_all_hypotheses();
+
+	// choose the hypothesis with the lowest held out RMS error, ignoring
+	// the worst held out points so outliers don't decide the winner
+	for (i=0; i < MULTIHYPOTHESES; i++) {
+		if (!(hypothesis[i].trB >= MINBFITUT && hypothesis[i].trB <= MAXBFITUT)) continue;
+		if (heldout_count > 0) {
+			for (n=0; n < heldout_count; n++) {
+				err[n] = fabsf(trial_error_pc(&hypothesis[i], heldout[n]));
+			}
+			limit = trim_limit(err, heldout_count);
+			sum = 0.0F;
+			used = 0;
+			for (n=0; n < heldout_count; n++) {
+				if (err[n] < limit) {
+					sum += err[n] * err[n];
+					used++;
+				}
+			}
+			score = used ? sqrtf(sum / (float)used) : limit;
+		} else {
+			score = hypothesis[i].trFitErrorpc;
+		}
+		if (score < best) {
+			best = score;
+			ibest = i;
+		}
+	}
+	if (ibest < 0) return 0;
+
+	// refit the winner with all the points
+	if (heldout_count > 0) {
+		memcpy(&hypothesis[ibest], &magcal, sizeof(MagCalibration_t));
+		solve_hypothesis(ibest);
+	}
+	// the held out error is an unbiased estimate, never report less
+	if (hypothesis[ibest].trFitErrorpc < best) hypothesis[ibest].trFitErrorpc = best;
+	magcal.trB = hypothesis[ibest].trB;
+	magcal.trFitErrorpc = hypothesis[ibest].trFitErrorpc;
+	for (i = X; i <= Z; i++) {
+		magcal.trV[i] = hypothesis[ibest].trV[i];
+		for (n = X; n <= Z; n++) {
+			magcal.trinvW[i][n] = hypothesis[ibest].trinvW[i][n];
+		}
+	}
+	return solver[ibest];
+}
+
+// continuous mode: every sample is added to an accumulator whose sums decay
+// with time constant continuous_tau, and the calibration is solved from it
+// rather than the buffer, so the calibration tracks slow hard iron drift.
+#define CONTINUOUSFITPC 4.0F        // continuous mode always tracks fits this good
+#define CONTINUOUSMINSPREAD 0.25F   // min std deviation of readings / DEFAULTB on every axis
+
+static float continuous_tau=0.0f;
+static double continuous_lambda=1.0;
+static MagCalAccum_t continuous_acc;
+static MagCalibration_t continuous_cal;
+
+// time constant in seconds, or 0 to disable
+void magcal_set_continuous(float tau)
+{
+	continuous_tau = (tau > 0.0f) ? tau : 0.0f;
+	continuous_lambda = (tau > 0.0f) ? exp(-1.0 / ((double)tau * (double)raw_data_rate())) : 1.0;
+	magcal_accum_init(&continuous_acc);
+}
+
+float magcal_get_continuous(void)
+{
+	return continuous_tau;
+}
+
+// O(1) per sample update of the decaying sums
+void magcal_continuous_add(int16_t rawx, int16_t rawy, int16_t rawz)
+{
+	if (continuous_tau <= 0.0f) return;
+	magcal_accum_decay(&continuous_acc, continuous_lambda);
+	magcal_accum_add(&continuous_acc, rawx, rawy, rawz);
+}
+
+// the decayed readings must spread in all 3 directions, or the ellipsoid
+// fit is meaningless (eg, the sensor has been still for a long time)
+static int continuous_spread_ok(const MagCalAccum_t *acc)
+{
+	static const int8_t first[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+	float cov[10][10], eigval[10], eigvec[10][10], mean[3], limit;
+	int i, j, k;
+
+	if (acc->count <= 0.0) return 0;
+	for (i = X; i <= Z; i++) {
+		mean[i] = (float)(acc->moment[moment_index(first[i][X], first[i][Y], first[i][Z])]
+			/ acc->count);
+	}
+	for (i = X; i <= Z; i++) {
+		for (j = X; j <= Z; j++) {
+			k = moment_index(first[i][X] + first[j][X], first[i][Y] + first[j][Y],
+				first[i][Z] + first[j][Z]);
+			cov[i][j] = (float)(acc->moment[k] / acc->count) - mean[i] * mean[j];
+		}
+	}
+	eigencompute(cov, eigval, eigvec, 3);
+	limit = CONTINUOUSMINSPREAD * CONTINUOUSMINSPREAD;
+	for (i = X; i <= Z; i++) {
+		if (eigval[i] < limit) return 0;
+	}
+	return 1;
+}
+
+static int continuous_solve(void)
+{
+	int i, j;
+
+	if (!continuous_spread_ok(&continuous_acc)) return 0;
+	if (!magcal_accum_solve(&continuous_acc, &continuous_cal)) return 0;
+	magcal.trB = continuous_cal.trB;
+	magcal.trFitErrorpc = continuous_cal.trFitErrorpc;
+	for (i = X; i <= Z; i++) {
+		magcal.trV[i] = continuous_cal.trV[i];
+		for (j = X; j <= Z; j++) {
+			magcal.trinvW[i][j] = continuous_cal.trinvW[i][j];
+		}
+	}
+	return 10;
+}
+
+static const char * solver_trace_name(int isolver)
+{
+	if (isolver == 4) return "solve 4INV";
+	if (isolver == 7) return "solve 7EIG";
+	if (isolver == 10) return "solve 10EIG";
+	return "solve none";
+}
+
 // run the magnetic calibration
 int MagCal_Run(void)
 {
 	int i, j;			// loop counters
 	int isolver;		// magnetic solver used
 	int count=0;
-	static int waitcount=0;
+	uint64_t t0, t1;
+
+	sched.samples++;
+	sched.since++;
+	if (warm_pending && magcal.ValidMagCal == 0) {
+		warm_check();
+		// a restored buffer may be another sensor's, don't solve from it yet
+		if (warm_restored) return 0;
+	}
 
-	// only do the calibration occasionally
-	if (++waitcount < 20) return 0;
-	waitcount = 0;
+	// only do the calibration when the buffer has changed enough
+	if (!sched_due()) return 0;
 
 	// count number of data points
 	for (i=0; i < MAGBUFFSIZE; i++) {
@@ -75,11 +681,17 @@ int MagCal_Run(void)
 
 	if (magcal.ValidMagCal) {
 		// age the existing fit error to avoid one good calibration locking out future updates
-		magcal.FitErrorAge *= 1.02f;
+		magcal.FitErrorAge *= powf(FITERRORAGEPERSEC, (float)sched.since / raw_data_rate());
 	}
 
+	t0 = monotonic_ns();
+	TRACE_BEGIN();
 	// is enough data collected
-	if (count < MINMEASUREMENTS7CAL) {
+	if (continuous_tau > 0.0f) {
+		isolver = continuous_solve();
+	} else if (multi_enabled) {
+		isolver = multi_solve(count);
+	} else if (count < MINMEASUREMENTS7CAL) {
 		isolver = 4;
 		fUpdateCalibration4INV(&magcal); // 4 element matrix inversion calibration
 		if (magcal.trFitErrorpc < 12.0f) magcal.trFitErrorpc = 12.0f;
@@ -91,6 +703,19 @@ int MagCal_Run(void)
 		isolver = 10;
 		fUpdateCalibration10EIG(&magcal); // 10 element eigenpair calibration
 	}
+	if (refine_enabled && isolver >= 7 && continuous_tau <= 0.0f) {
+		// geometric refinement of the algebraic fit.  Not in continuous
+		// mode: it would refit to every buffered reading, stale ones
+		// included, and undo the forgetting
+		t1 = monotonic_ns();
+		sched.refine_iterations += fRefineCalibrationLM(&magcal,
+			(pinned_solve_ns > 0.0f) ? ~0ull : LMBUDGETNS);
+		sched.refine_ns += monotonic_ns() - t1;
+		if (isolver == 7 && magcal.trFitErrorpc < 7.5f) magcal.trFitErrorpc = 7.5f;
+	}
+	sched_solved(monotonic_ns() - t0);
+	TRACE_END(solver_trace_name(isolver), count);
+	if (isolver == 0) return 0;
 
 	// the trial geomagnetic field must be in range (earth is 22uT to 67uT)
 	if ((magcal.trB >= MINBFITUT) && (magcal.trB <= MAXBFITUT))	{
@@ -98,11 +723,20 @@ int MagCal_Run(void)
 		//  1: no previous calibration exists
 		//  2: the calibration fit is reduced or
 		//  3: an improved solver was used giving a good trial calibration (4% or under)
+		//  4: continuous mode is tracking drift with a good trial calibration
 		if ((magcal.ValidMagCal == 0) ||
 				(magcal.trFitErrorpc <= magcal.FitErrorAge) ||
-				((isolver > magcal.ValidMagCal) && (magcal.trFitErrorpc <= 4.0F))) {
+				((isolver > magcal.ValidMagCal) && (magcal.trFitErrorpc <= 4.0F)) ||
+				((continuous_tau > 0.0f) && (magcal.trFitErrorpc <= CONTINUOUSFITPC))) {
 			// accept the new calibration solution
 			//printf("new magnetic cal, B=%.2f uT\n", magcal.trB);
+			if (magcal.ValidMagCal == 0 && sched.first_valid == 0) {
+				sched.first_valid = sched.samples;
+				sched.first_valid_ns = monotonic_ns();
+			}
+			sched.accepted++;
+			generation++;
+			warm_pending = 0;  // the solvers have their own answer now
 			magcal.ValidMagCal = isolver;
 			magcal.FitError = magcal.trFitErrorpc;
 			if (magcal.trFitErrorpc > 2.0f) {
@@ -118,6 +752,7 @@ int MagCal_Run(void)
 					magcal.invW[i][j] = magcal.trinvW[i][j];
 				}
 			}
+			recording_event(REC_ACCEPT, 0);
 			return 1; // indicates new calibration applied
 		}
 	}
@@ -127,7 +762,7 @@ int MagCal_Run(void)
 
 
 // 4 element calibration using 4x4 matrix inverse
-static void fUpdateCalibration4INV(MagCalibration_t *MagCal)
+void fUpdateCalibration4INV(MagCalibration_t *MagCal)
 {
 	float fBp2;					// fBp[X]^2+fBp[Y]^2+fBp[Z]^2
 	float fSumBp4;				// sum of fBp2
@@ -295,7 +930,7 @@ static void fUpdateCalibration4INV(MagCalibration_t *MagCal)
 
 
 // 7 element calibration using direct eigen-decomposition
-static void fUpdateCalibration7EIG(MagCalibration_t *MagCal)
+void fUpdateCalibration7EIG(MagCalibration_t *MagCal)
 {
 	float det;					// matrix determinant
 	float fscaling;				// set to FUTPERCOUNT * FMATRIXSCALING
@@ -369,7 +1004,7 @@ static void fUpdateCalibration7EIG(MagCalibration_t *MagCal)
 	}
 
 	// set tmpA7x1 to the unsorted eigenvalues and matB to the unsorted eigenvectors of matA
-	eigencompute(MagCal->matA, MagCal->vecA, MagCal->matB, 7);
+	MagCal->EigSweeps = eigencompute(MagCal->matA, MagCal->vecA, MagCal->matB, 7);
 
 	// find the smallest eigenvalue
 	j = 0;
@@ -428,14 +1063,13 @@ static void fUpdateCalibration7EIG(MagCalibration_t *MagCal)
 
 
 // 10 element calibration using direct eigen-decomposition
-static void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
+void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
 {
-	float det;					// matrix determinant
 	float fscaling;				// set to FUTPERCOUNT * FMATRIXSCALING
-	float ftmp;					// scratch variable
+	float fOffset[3];			// offset removed from the measurements (uT)
 	int16_t iOffset[3];			// offset to remove large DC hard iron bias in matrix
 	int16_t iCount;				// number of measurements counted
-	int i, j, k, m, n;			// loop counters
+	int j, k, m, n;				// loop counters
 
 	// compute fscaling to reduce multiplications later
 	fscaling = FXOS8700_UTPERCOUNT / DEFAULTB;
@@ -500,6 +1134,23 @@ static void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
 	// store the number of measurements accumulated
 	MagCal->MagBufferCount = iCount;
 
+	// solve using the offset (uT) which was removed from the measurements
+	for (k = X; k <= Z; k++) {
+		fOffset[k] = (float)iOffset[k] * FXOS8700_UTPERCOUNT;
+	}
+	fSolveCalibration10EIG(MagCal, (float)iCount, fOffset);
+}
+
+// second half of the 10 element calibration, shared by the buffer and the
+// accumulator calibrations: solve the on and above diagonal elements of the
+// 10x10 matA for the trial calibration.  fCount is the number of measurements
+// and fOffset the offset (uT) removed from them.
+static void fSolveCalibration10EIG(MagCalibration_t *MagCal, float fCount, const float fOffset[3])
+{
+	float det;					// matrix determinant
+	float ftmp;					// scratch variable
+	int i, j, k, m, n;			// loop counters
+
 	// copy the above diagonal elements of symmetric product matrix matA to below the diagonal
 	for (m = 1; m < 10; m++) {
 		for (n = 0; n < m; n++) {
@@ -509,7 +1160,7 @@ static void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
 
 	// set MagCal->vecA to the unsorted eigenvalues and matB to the unsorted
 	// normalized eigenvectors of matA
-	eigencompute(MagCal->matA, MagCal->vecA, MagCal->matB, 10);
+	MagCal->EigSweeps = eigencompute(MagCal->matA, MagCal->vecA, MagCal->matB, 10);
 
 	// set ellipsoid matrix A from elements of the solution vector column j with
 	// smallest eigenvalue
@@ -559,13 +1210,13 @@ static void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
 
 	// calculate the trial normalized fit error as a percentage
 	MagCal->trFitErrorpc = 50.0F * sqrtf(
-		fabs(MagCal->vecA[j]) / (float) MagCal->MagBufferCount) /
+		fabs(MagCal->vecA[j]) / fCount) /
 		(MagCal->trB * MagCal->trB);
 
 	// correct for the measurement matrix offset and scaling and
 	// get the computed hard iron offset in uT
 	for (k = X; k <= Z; k++) {
-		MagCal->trV[k] = MagCal->trV[k] * DEFAULTB + (float)iOffset[k] * FXOS8700_UTPERCOUNT;
+		MagCal->trV[k] = MagCal->trV[k] * DEFAULTB + fOffset[k];
 	}
 
 	// convert the trial geomagnetic field strength B into uT for
@@ -616,4 +1267,396 @@ static void fUpdateCalibration10EIG(MagCalibration_t *MagCal)
 
 
 
+// Levenberg-Marquardt refinement of the trial calibration, minimizing the
+// geometric residual r = |M.(Bp - V)| - 1 where M = invW / B, rather than
+// the algebraic residual minimized by the eigenpair solvers.  Starts from
+// trV, trinvW and trB.  Uses matA, matB and vecA as scratch.  Iterations
+// stop when the time budget would be exceeded by another iteration.
+// Returns the number of iterations run.
+
+// sum of squared residuals, and optionally J^T.J (in matA) and J^T.r (in vecA)
+static float fLMResiduals(MagCalibration_t *MagCal, const float *bx, const float *by,
+	const float *bz, int n, const float p[9], int jacobian)
+{
+	float ux, uy, uz, wx, wy, wz, norm, rinv, r, sum=0.0F;
+	float jac[9];
+	int i, k, m;
+
+	if (jacobian) {
+		for (k = 0; k < 9; k++) {
+			MagCal->vecA[k] = 0.0F;
+			for (m = k; m < 9; m++) {
+				MagCal->matA[k][m] = 0.0F;
+			}
+		}
+	}
+	// p[0-2] = V, p[3-8] = M00, M01, M02, M11, M12, M22
+	for (i = 0; i < n; i++) {
+		ux = bx[i] - p[0];
+		uy = by[i] - p[1];
+		uz = bz[i] - p[2];
+		wx = p[3] * ux + p[4] * uy + p[5] * uz;
+		wy = p[4] * ux + p[6] * uy + p[7] * uz;
+		wz = p[5] * ux + p[7] * uy + p[8] * uz;
+		norm = sqrtf(wx * wx + wy * wy + wz * wz);
+		r = norm - 1.0F;
+		sum += r * r;
+		if (!jacobian || norm == 0.0F) continue;
+		rinv = 1.0F / norm;
+		// dr/dV = -M.w / |w|
+		jac[0] = -(p[3] * wx + p[4] * wy + p[5] * wz) * rinv;
+		jac[1] = -(p[4] * wx + p[6] * wy + p[7] * wz) * rinv;
+		jac[2] = -(p[5] * wx + p[7] * wy + p[8] * wz) * rinv;
+		// dr/dM, off diagonal terms appear twice in symmetric M
+		jac[3] = wx * ux * rinv;
+		jac[4] = (wx * uy + wy * ux) * rinv;
+		jac[5] = (wx * uz + wz * ux) * rinv;
+		jac[6] = wy * uy * rinv;
+		jac[7] = (wy * uz + wz * uy) * rinv;
+		jac[8] = wz * uz * rinv;
+		for (k = 0; k < 9; k++) {
+			MagCal->vecA[k] += jac[k] * r;
+			for (m = k; m < 9; m++) {
+				MagCal->matA[k][m] += jac[k] * jac[m];
+			}
+		}
+	}
+	return sum;
+}
+
+int fRefineCalibrationLM(MagCalibration_t *MagCal, uint64_t budget_ns)
+{
+	float bx[MAGBUFFSIZE], by[MAGBUFFSIZE], bz[MAGBUFFSIZE];
+	float p[9], ptrial[9];
+	float cost, newcost, lambda, det, ftmp;
+	uint64_t start, now, itertime=0;
+	int i, k, m, n, iter;
+
+	// working arrays for 9x9 matrix inversion
+	float *pfRows[9];
+	int8_t iColInd[9];
+	int8_t iRowInd[9];
+	int8_t iPivot[9];
+
+	start = monotonic_ns();
+	if (MagCal->trB <= 0.0F) return 0;
+
+	// gather the valid points in uT into packed arrays
+	n = 0;
+	for (i = 0; i < MAGBUFFSIZE; i++) {
+		if (MagCal->valid[i]) {
+			bx[n] = (float)MagCal->BpFast[X][i] * FXOS8700_UTPERCOUNT;
+			by[n] = (float)MagCal->BpFast[Y][i] * FXOS8700_UTPERCOUNT;
+			bz[n] = (float)MagCal->BpFast[Z][i] * FXOS8700_UTPERCOUNT;
+			n++;
+		}
+	}
+	if (n < MINMEASUREMENTS4CAL) return 0;
+
+	ftmp = 1.0F / MagCal->trB;
+	p[0] = MagCal->trV[X];
+	p[1] = MagCal->trV[Y];
+	p[2] = MagCal->trV[Z];
+	p[3] = MagCal->trinvW[X][X] * ftmp;
+	p[4] = MagCal->trinvW[X][Y] * ftmp;
+	p[5] = MagCal->trinvW[X][Z] * ftmp;
+	p[6] = MagCal->trinvW[Y][Y] * ftmp;
+	p[7] = MagCal->trinvW[Y][Z] * ftmp;
+	p[8] = MagCal->trinvW[Z][Z] * ftmp;
+
+	lambda = LMLAMBDAINIT;
+	cost = fLMResiduals(MagCal, bx, by, bz, n, p, 1);
+	for (iter = 0; iter < LMITERATIONS; iter++) {
+		// don't start an iteration which would overrun the budget
+		now = monotonic_ns();
+		if (now - start + itertime > budget_ns) break;
+
+		// solve (J^T.J + lambda.diag(J^T.J)).delta = -J^T.r
+		for (k = 0; k < 9; k++) {
+			for (m = k; m < 9; m++) {
+				MagCal->matB[k][m] = MagCal->matB[m][k] = MagCal->matA[k][m];
+			}
+			MagCal->matB[k][k] *= 1.0F + lambda;
+			pfRows[k] = MagCal->matB[k];
+		}
+		fmatrixAeqInvA(pfRows, iColInd, iRowInd, iPivot, 9);
+		for (k = 0; k < 9; k++) {
+			ftmp = 0.0F;
+			for (m = 0; m < 9; m++) {
+				ftmp += MagCal->matB[k][m] * MagCal->vecA[m];
+			}
+			ptrial[k] = p[k] - ftmp;
+		}
+		newcost = fLMResiduals(MagCal, bx, by, bz, n, ptrial, 0);
+		if (newcost < cost) {
+			for (k = 0; k < 9; k++) p[k] = ptrial[k];
+			lambda *= 0.1F;
+			// converged when the improvement is negligible
+			if (cost - newcost < cost * 1e-6F) {
+				cost = newcost;
+				iter++;
+				break;
+			}
+			cost = fLMResiduals(MagCal, bx, by, bz, n, p, 1);
+		} else {
+			lambda *= 10.0F;
+		}
+		itertime = monotonic_ns() - now;
+	}
+
+	// M = invW / B with invW normalized to unit determinant
+	MagCal->A[X][X] = p[3];
+	MagCal->A[X][Y] = MagCal->A[Y][X] = p[4];
+	MagCal->A[X][Z] = MagCal->A[Z][X] = p[5];
+	MagCal->A[Y][Y] = p[6];
+	MagCal->A[Y][Z] = MagCal->A[Z][Y] = p[7];
+	MagCal->A[Z][Z] = p[8];
+	det = f3x3matrixDetA(MagCal->A);
+	if (det <= 0.0F) return iter;
+	ftmp = 100.0F * sqrtf(cost / (float)n);
+	// only keep the refinement if it reduced the geometric error
+	if (ftmp >= MagCal->trFitErrorpc) return iter;
+	MagCal->trFitErrorpc = ftmp;
+	MagCal->trB = powf(det, -(ONETHIRD));
+	for (k = X; k <= Z; k++) {
+		MagCal->trV[k] = p[k];
+		for (m = X; m <= Z; m++) {
+			MagCal->trinvW[k][m] = MagCal->A[k][m] * MagCal->trB;
+		}
+	}
+	return iter;
+}
+
 
+
+
+// Mergeable calibration accumulators.  The 10x10 matrix X^T.X used by the
+// 10 element calibration holds sums of products of the readings up to 4th
+// order, so all of it can be rebuilt from the 35 raw moments
+// sum(x^i.y^j.z^k), i+j+k <= 4.  Moments are plain sums, so accumulators
+// built on separate threads or machines can be merged by moving them to
+// a common offset (binomial expansion) and adding.  Any number of samples
+// may be accumulated, not just MAGBUFFSIZE.
+
+#define MAGACCUMSCALING (FXOS8700_UTPERCOUNT / DEFAULTB)
+#define MAGACCUMMAGIC 0x3141434DUL  // "MCA1" in little endian
+
+// index of moment x^i.y^j.z^k, ordered by degree
+static int moment_index(int i, int j, int k)
+{
+	int d = i + j + k;
+	int a = j + k;
+
+	return d * (d + 1) * (d + 2) / 6 + a * (a + 1) / 2 + k;
+}
+
+void magcal_accum_init(MagCalAccum_t *acc)
+{
+	memset(acc, 0, sizeof(MagCalAccum_t));
+}
+
+void magcal_accum_add(MagCalAccum_t *acc, int16_t rawx, int16_t rawy, int16_t rawz)
+{
+	double px[5], py[5], pz[5];
+	int i, j, k;
+
+	// the first sample sets the offset, keeping the moments small
+	if (acc->count == 0.0) {
+		acc->offset[X] = rawx;
+		acc->offset[Y] = rawy;
+		acc->offset[Z] = rawz;
+	}
+	px[0] = py[0] = pz[0] = 1.0;
+	px[1] = ((double)rawx - acc->offset[X]) * MAGACCUMSCALING;
+	py[1] = ((double)rawy - acc->offset[Y]) * MAGACCUMSCALING;
+	pz[1] = ((double)rawz - acc->offset[Z]) * MAGACCUMSCALING;
+	for (i = 2; i <= 4; i++) {
+		px[i] = px[i - 1] * px[1];
+		py[i] = py[i - 1] * py[1];
+		pz[i] = pz[i - 1] * pz[1];
+	}
+	for (i = 0; i <= 4; i++) {
+		for (j = 0; j <= 4 - i; j++) {
+			for (k = 0; k <= 4 - i - j; k++) {
+				acc->moment[moment_index(i, j, k)] += px[i] * py[j] * pz[k];
+			}
+		}
+	}
+	acc->count += 1.0;
+}
+
+// multiply all sums by factor, so older samples count for less
+void magcal_accum_decay(MagCalAccum_t *acc, double factor)
+{
+	int n;
+
+	for (n = 0; n < MAGACCUM_MOMENTS; n++) {
+		acc->moment[n] *= factor;
+	}
+	acc->count *= factor;
+}
+
+// compute the moments of acc about a different offset (counts)
+static void accum_recenter(const MagCalAccum_t *acc, const double offset[3],
+	double moment[MAGACCUM_MOMENTS])
+{
+	static const double binomial[5][5] = {
+		{1, 0, 0, 0, 0}, {1, 1, 0, 0, 0}, {1, 2, 1, 0, 0},
+		{1, 3, 3, 1, 0}, {1, 4, 6, 4, 1}
+	};
+	double dx[5], dy[5], dz[5], sum;
+	int i, j, k, a, b, c;
+
+	// new coordinate = old coordinate + d
+	dx[0] = dy[0] = dz[0] = 1.0;
+	dx[1] = (acc->offset[X] - offset[X]) * MAGACCUMSCALING;
+	dy[1] = (acc->offset[Y] - offset[Y]) * MAGACCUMSCALING;
+	dz[1] = (acc->offset[Z] - offset[Z]) * MAGACCUMSCALING;
+	for (i = 2; i <= 4; i++) {
+		dx[i] = dx[i - 1] * dx[1];
+		dy[i] = dy[i - 1] * dy[1];
+		dz[i] = dz[i - 1] * dz[1];
+	}
+	for (i = 0; i <= 4; i++) {
+		for (j = 0; j <= 4 - i; j++) {
+			for (k = 0; k <= 4 - i - j; k++) {
+				sum = 0.0;
+				for (a = 0; a <= i; a++) {
+					for (b = 0; b <= j; b++) {
+						for (c = 0; c <= k; c++) {
+							sum += binomial[i][a] * binomial[j][b] * binomial[k][c]
+								* dx[i - a] * dy[j - b] * dz[k - c]
+								* acc->moment[moment_index(a, b, c)];
+						}
+					}
+				}
+				moment[moment_index(i, j, k)] = sum;
+			}
+		}
+	}
+}
+
+void magcal_accum_merge(MagCalAccum_t *dst, const MagCalAccum_t *src)
+{
+	double moment[MAGACCUM_MOMENTS];
+	int n;
+
+	if (src->count == 0.0) return;
+	if (dst->count == 0.0) {
+		memcpy(dst, src, sizeof(MagCalAccum_t));
+		return;
+	}
+	accum_recenter(src, dst->offset, moment);
+	for (n = 0; n < MAGACCUM_MOMENTS; n++) {
+		dst->moment[n] += moment[n];
+	}
+	dst->count += src->count;
+}
+
+static uint8_t * put_double(uint8_t *p, double d)
+{
+	union {
+		double d;
+		uint64_t n;
+	} data;
+	int i;
+
+	data.d = d;
+	for (i = 0; i < 8; i++) {
+		*p++ = data.n >> (i * 8);
+	}
+	return p;
+}
+
+static const uint8_t * get_double(const uint8_t *p, double *d)
+{
+	union {
+		double d;
+		uint64_t n;
+	} data;
+	int i;
+
+	data.n = 0;
+	for (i = 0; i < 8; i++) {
+		data.n |= (uint64_t)(*p++) << (i * 8);
+	}
+	*d = data.d;
+	return p;
+}
+
+// write acc in a portable little endian format, returns bytes used or 0
+int magcal_accum_serialize(const MagCalAccum_t *acc, uint8_t *buf, int len)
+{
+	uint8_t *p = buf;
+	int n;
+
+	if (len < MAGACCUM_SERIAL_SIZE) return 0;
+	*p++ = MAGACCUMMAGIC & 255;
+	*p++ = (MAGACCUMMAGIC >> 8) & 255;
+	*p++ = (MAGACCUMMAGIC >> 16) & 255;
+	*p++ = (MAGACCUMMAGIC >> 24) & 255;
+	p = put_double(p, acc->count);
+	for (n = X; n <= Z; n++) {
+		p = put_double(p, acc->offset[n]);
+	}
+	for (n = 0; n < MAGACCUM_MOMENTS; n++) {
+		p = put_double(p, acc->moment[n]);
+	}
+	return p - buf;
+}
+
+// read an accumulator written by magcal_accum_serialize, returns bytes used or 0
+int magcal_accum_deserialize(MagCalAccum_t *acc, const uint8_t *buf, int len)
+{
+	const uint8_t *p = buf;
+	int n;
+
+	if (len < MAGACCUM_SERIAL_SIZE) return 0;
+	if ((p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24))
+	  != MAGACCUMMAGIC) return 0;
+	p += 4;
+	p = get_double(p, &acc->count);
+	for (n = X; n <= Z; n++) {
+		p = get_double(p, &acc->offset[n]);
+	}
+	for (n = 0; n < MAGACCUM_MOMENTS; n++) {
+		p = get_double(p, &acc->moment[n]);
+	}
+	return p - buf;
+}
+
+// solve the 10 element calibration from an accumulator, setting the trial
+// values in MagCal.  Returns 1 if the trial field strength is plausible.
+int magcal_accum_solve(const MagCalAccum_t *acc, MagCalibration_t *MagCal)
+{
+	// measurement vector elements as a coefficient times x^i.y^j.z^k
+	static const int8_t coef[10] = {1, 2, 2, 1, 2, 1, 1, 1, 1, 1};
+	static const int8_t expo[10][3] = {
+		{2, 0, 0}, {1, 1, 0}, {1, 0, 1}, {0, 2, 0}, {0, 1, 1},
+		{0, 0, 2}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, 0}
+	};
+	double moment[MAGACCUM_MOMENTS];
+	double centroid[3];
+	float fOffset[3];
+	int k, m, n;
+
+	if (acc->count < (double)MINMEASUREMENTS10CAL) return 0;
+
+	// re-centre on the mean reading, which best conditions the matrix
+	for (k = X; k <= Z; k++) {
+		centroid[k] = acc->offset[k] + acc->moment[moment_index(k == X, k == Y, k == Z)]
+			/ acc->count / MAGACCUMSCALING;
+		fOffset[k] = (float)(centroid[k] * FXOS8700_UTPERCOUNT);
+	}
+	accum_recenter(acc, centroid, moment);
+
+	for (m = 0; m < 10; m++) {
+		for (n = m; n < 10; n++) {
+			MagCal->matA[m][n] = (float)(coef[m] * coef[n] * moment[moment_index(
+				expo[m][X] + expo[n][X], expo[m][Y] + expo[n][Y], expo[m][Z] + expo[n][Z])]);
+		}
+	}
+	MagCal->MagBufferCount = (acc->count > 32767.0) ? 32767 : (int16_t)acc->count;
+	fSolveCalibration10EIG(MagCal, (float)acc->count, fOffset);
+	return (MagCal->trB >= MINBFITUT) && (MagCal->trB <= MAXBFITUT);
+}
@@ -30,7 +30,6 @@
 #define twoKpDef	(2.0f * 0.02f)	// 2 * proportional gain
 #define twoKiDef	(2.0f * 0.0f)	// 2 * integral gain
 
-#define INV_SAMPLE_RATE  (1.0f / SENSORFS)
 
 //----------------------------------------------------------------------------------------------
 // Variable definitions
@@ -39,6 +38,7 @@ static float twoKp = twoKpDef;		// 2 * proportional gain (Kp)
 static float twoKi = twoKiDef;		// 2 * integral gain (Ki)
 static float q0 = 1.0f, q1 = 0.0f, q2 = 0.0f, q3 = 0.0f; // quaternion of sensor frame relative to auxiliary frame
 static float integralFBx = 0.0f,  integralFBy = 0.0f, integralFBz = 0.0f; // integral error terms scaled by Ki
+static float invSampleRate = 1.0f / SENSORFS;	// interval ending at the current gyro reading (s)
 
 
 //==============================================================================================
@@ -70,13 +70,14 @@ void fusion_update(const AccelSensor_t *Accel, const MagSensor_t *Mag, const Gyr
 	mx = Mag->Bc[0];
 	my = Mag->Bc[1];
 	mz = Mag->Bc[2];
-	for (i=0; i < OVERSAMPLE_RATIO; i++) {
+	for (i=0; i < raw_data_oversample(); i++) {
 		gx = Gyro->YpFast[i][0];
 		gy = Gyro->YpFast[i][1];
 		gz = Gyro->YpFast[i][2];
 		gx *= factor;
 		gy *= factor;
 		gz *= factor;
+		invSampleRate = Gyro->dtFast[i];
 		mahony_update(gx, gy, gz, ax, ay, az, mx, my, mz);
 	}
 }
@@ -99,6 +100,7 @@ static void mahony_init()
 
 	twoKp = twoKpDef;	// 2 * proportional gain (Kp)
 	twoKi = twoKiDef;	// 2 * integral gain (Ki)
+	invSampleRate = 1.0f / raw_data_rate();
 	if (first) {
 		q0 = 1.0f;
 		q1 = 0.0f;	// TODO: set a flag to immediately capture
@@ -186,9 +188,9 @@ static void mahony_update(float gx, float gy, float gz, float ax, float ay, floa
 		// Compute and apply integral feedback if enabled
 		if(twoKi > 0.0f) {
 			// integral error scaled by Ki
-			integralFBx += twoKi * halfex * INV_SAMPLE_RATE;
-			integralFBy += twoKi * halfey * INV_SAMPLE_RATE;
-			integralFBz += twoKi * halfez * INV_SAMPLE_RATE;
+			integralFBx += twoKi * halfex * invSampleRate;
+			integralFBy += twoKi * halfey * invSampleRate;
+			integralFBz += twoKi * halfez * invSampleRate;
 			gx += integralFBx;	// apply integral feedback
 			gy += integralFBy;
 			gz += integralFBz;
@@ -214,9 +216,9 @@ static void mahony_update(float gx, float gy, float gz, float ax, float ay, floa
 	}
 
 	// Integrate rate of change of quaternion
-	gx *= (0.5f * INV_SAMPLE_RATE);		// pre-multiply common factors
-	gy *= (0.5f * INV_SAMPLE_RATE);
-	gz *= (0.5f * INV_SAMPLE_RATE);
+	gx *= (0.5f * invSampleRate);		// pre-multiply common factors
+	gy *= (0.5f * invSampleRate);
+	gz *= (0.5f * invSampleRate);
 	qa = q0;
 	qb = q1;
 	qc = q2;
@@ -266,9 +268,9 @@ void mahony_updateIMU(float gx, float gy, float gz, float ax, float ay, float az
 		// Compute and apply integral feedback if enabled
 		if(twoKi > 0.0f) {
 			// integral error scaled by Ki
-			integralFBx += twoKi * halfex * INV_SAMPLE_RATE;
-			integralFBy += twoKi * halfey * INV_SAMPLE_RATE;
-			integralFBz += twoKi * halfez * INV_SAMPLE_RATE;
+			integralFBx += twoKi * halfex * invSampleRate;
+			integralFBy += twoKi * halfey * invSampleRate;
+			integralFBz += twoKi * halfez * invSampleRate;
 			gx += integralFBx;	// apply integral feedback
 			gy += integralFBy;
 			gz += integralFBz;
@@ -285,9 +287,9 @@ void mahony_updateIMU(float gx, float gy, float gz, float ax, float ay, float az
 	}
 
 	// Integrate rate of change of quaternion
-	gx *= (0.5f * INV_SAMPLE_RATE);		// pre-multiply common factors
-	gy *= (0.5f * INV_SAMPLE_RATE);
-	gz *= (0.5f * INV_SAMPLE_RATE);
+	gx *= (0.5f * invSampleRate);		// pre-multiply common factors
+	gy *= (0.5f * invSampleRate);
+	gz *= (0.5f * invSampleRate);
 	qa = q0;
 	qb = q1;
 	qc = q2;
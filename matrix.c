@@ -162,7 +162,8 @@ float f3x3matrixDetA(float A[][3])
 // eigval[0..n-1] returns the eigenvalues of A[][].
 // eigvec[0..n-1][0..n-1] returns the normalized eigenvectors of A[][]
 // the eigenvectors are not sorted by value
-void eigencompute(float A[][10], float eigval[], float eigvec[][10], int8_t n)
+// returns the number of Jacobi sweeps used
+int eigencompute(float A[][10], float eigval[], float eigvec[][10], int8_t n)
 {
 	// maximum number of iterations to achieve convergence: in practice 6 is typical
 #define NITERATIONS 15
@@ -285,6 +286,7 @@ void eigencompute(float A[][10], float eigval[], float eigvec[][10], int8_t n)
 			}   // end of loop over rows
 		}  // end of test for non-zero residue
 	} while ((residue > 0.0F) && (ctr++ < NITERATIONS)); // end of main loop
+	return ctr;
 }
 
 // function uses Gauss-Jordan elimination to compute the inverse of matrix A in situ
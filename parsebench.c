@@ -0,0 +1,218 @@
+// Serial parser throughput benchmark
+//
+// Usage: parsebench
+//
+// Builds large synthetic streams in both wire formats and feeds them to
+// newdata() at several read sizes.  The data callbacks only count, so the
+// numbers are the cost of packet_parse() and ascii_parse() alone.  Output
+// is one JSON object per line.
+//
+//   ascii   "Raw:" lines with a Cal1/Cal2 confirmation pair every 500
+//   binary  0x7E framed type 1 (orientation) and type 6 (mag buffer)
+//           packets, with values chosen so many need 0x7D escapes
+//   mixed   both formats interleaved with random garbage bytes
+
+#include "imuread.h"
+
+#define STREAM_SIZE   (8 * 1024 * 1024)
+#define BENCH_MIN_NS  200000000 // repeat each stream for at least 0.2 s
+#define GARBAGE_RATE  50        // mixed stream: 1 in 50 records followed by junk
+
+MagCalibration_t magcal;
+Quaternion_t current_orientation;
+SampleTime_t current_orientation_time;
+
+static unsigned char stream[STREAM_SIZE];
+static int stream_len;
+static uint32_t stream_records;
+static uint32_t parsed;
+
+void raw_data_timed(const int16_t *data, const SampleTime_t *time)
+{
+	parsed++;
+}
+
+void cal1_data(const float *data)
+{
+	parsed++;
+}
+
+void cal2_data(const float *data)
+{
+	parsed++;
+}
+
+static uint32_t lcg_state;
+static uint32_t lcg(void)
+{
+	lcg_state = lcg_state * 1664525 + 1013904223;
+	return lcg_state >> 8;
+}
+
+static int16_t random_int16(void)
+{
+	return (int16_t)(lcg() & 0xFFFF);
+}
+
+static int put_ascii_raw(unsigned char *p)
+{
+	return sprintf((char *)p, "Raw:%d,%d,%d,%d,%d,%d,%d,%d,%d\r\n",
+		random_int16() >> 4, random_int16() >> 4, random_int16() >> 2,
+		random_int16() >> 6, random_int16() >> 6, random_int16() >> 6,
+		random_int16() >> 6, random_int16() >> 6, random_int16() >> 6);
+}
+
+static int put_ascii_cal(unsigned char *p)
+{
+	int n;
+
+	n = sprintf((char *)p, "Cal1:0.012,-0.034,0.005,10.210,-4.500,37.800,"
+		"0.991,0.043,1.007,52.310\r\n");
+	n += sprintf((char *)p + n, "Cal2:0.991,0.012,-0.003,0.012,1.004,0.021,"
+		"-0.003,0.021,0.985\r\n");
+	return n;
+}
+
+// frame a packet: 0x7E, payload with 0x7E/0x7D escaped, 0x7E
+static int put_framed(unsigned char *p, const unsigned char *payload, int len)
+{
+	int i, n=0;
+
+	p[n++] = 0x7E;
+	for (i=0; i < len; i++) {
+		if (payload[i] == 0x7E || payload[i] == 0x7D) {
+			p[n++] = 0x7D;
+			p[n++] = (payload[i] == 0x7E) ? 0x5E : 0x5D;
+		} else {
+			p[n++] = payload[i];
+		}
+	}
+	p[n++] = 0x7E;
+	return n;
+}
+
+// 1 in 8 payload bytes is a 0x7E or 0x7D, so escaping is exercised
+static unsigned char payload_byte(void)
+{
+	uint32_t r = lcg();
+
+	if ((r & 7) == 0) return (r & 8) ? 0x7E : 0x7D;
+	return (r >> 4) & 255;
+}
+
+static int put_binary(unsigned char *p)
+{
+	unsigned char payload[34];
+	int i, len, id;
+
+	if (lcg() & 1) {
+		len = 34;
+		payload[0] = 1;
+	} else {
+		len = 14;
+		payload[0] = 6;
+	}
+	for (i=1; i < len; i++) {
+		payload[i] = payload_byte();
+	}
+	if (len == 14) {
+		id = 10 + lcg() % MAGBUFFSIZE;
+		payload[6] = id & 255;
+		payload[7] = id >> 8;
+	}
+	return put_framed(p, payload, len);
+}
+
+static int put_garbage(unsigned char *p)
+{
+	int i, n;
+
+	n = 1 + lcg() % 40;
+	for (i=0; i < n; i++) {
+		p[i] = lcg() & 255;
+	}
+	return n;
+}
+
+#define STREAM_ASCII  0
+#define STREAM_BINARY 1
+#define STREAM_MIXED  2
+
+static void build_stream(int type)
+{
+	unsigned char *p = stream;
+	unsigned char *end = stream + STREAM_SIZE - 512;
+
+	lcg_state = 54321 + type;
+	stream_records = 0;
+	while (p < end) {
+		if (type == STREAM_ASCII || (type == STREAM_MIXED && (lcg() & 1))) {
+			if (stream_records % 500 == 499) {
+				p += put_ascii_cal(p);
+				stream_records += 2;
+			} else {
+				p += put_ascii_raw(p);
+				stream_records++;
+			}
+		} else {
+			p += put_binary(p);
+			stream_records++;
+		}
+		if (type == STREAM_MIXED && lcg() % GARBAGE_RATE == 0) {
+			p += put_garbage(p);
+		}
+	}
+	stream_len = p - stream;
+}
+
+static void feed(int chunk)
+{
+	int i, n;
+
+	for (i=0; i < stream_len; i += n) {
+		n = chunk;
+		// chunk 0 means random read sizes, like a busy USB serial port
+		if (n == 0) n = 1 + lcg() % 4096;
+		if (n > stream_len - i) n = stream_len - i;
+		newdata(stream + i, n);
+	}
+}
+
+static void bench(const char *name, int chunk)
+{
+	uint64_t t0, ns=0;
+	uint32_t passes=0;
+	double secs;
+
+	parsed = 0;
+	while (ns < BENCH_MIN_NS) {
+		t0 = monotonic_ns();
+		feed(chunk);
+		ns += monotonic_ns() - t0;
+		passes++;
+	}
+	secs = (double)ns * 1e-9;
+	printf("{\"bench\":\"parse\",\"stream\":\"%s\",\"chunk\":%d,\"bytes\":%d,"
+		"\"records\":%u,\"ascii_parsed\":%u,\"mb_per_sec\":%.2f,"
+		"\"samples_per_sec\":%.0f,\"ns_per_byte\":%.2f}\n", name, chunk,
+		stream_len, stream_records, parsed / passes,
+		(double)stream_len * passes / secs / 1e6,
+		(double)stream_records * passes / secs,
+		(double)ns / ((double)stream_len * passes));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[] = {"ascii", "binary", "mixed"};
+	static const int chunks[] = {1, 64, 256, 4096, 0};
+	int type, i;
+
+	for (type = STREAM_ASCII; type <= STREAM_MIXED; type++) {
+		build_stream(type);
+		for (i=0; i < sizeof(chunks) / sizeof(int); i++) {
+			bench(names[type], chunks[i]);
+		}
+	}
+	return 0;
+}
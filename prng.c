@@ -0,0 +1,62 @@
+#include "imuread.h"
+
+// xoshiro128** by David Blackman and Sebastiano Vigna, seeded through
+// splitmix64.  Each calibration session carries its own generator, so a
+// given seed always makes the same eviction choices on every platform,
+// and sessions never share libc's random() state or its lock.
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+	z = (*x += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+void prng_seed(Prng_t *rng, uint64_t seed)
+{
+	uint64_t n;
+
+	// splitmix64 never gives the all zero state xoshiro can't leave
+	n = splitmix64(&seed);
+	rng->s[0] = (uint32_t)n;
+	rng->s[1] = (uint32_t)(n >> 32);
+	n = splitmix64(&seed);
+	rng->s[2] = (uint32_t)n;
+	rng->s[3] = (uint32_t)(n >> 32);
+}
+
+static uint32_t rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+uint32_t prng_next(Prng_t *rng)
+{
+	uint32_t *s = rng->s;
+	uint32_t result, t;
+
+	result = rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+	return result;
+}
+
+// 0 to n-1, by multiply and shift rather than a slow and biased modulus
+uint32_t prng_below(Prng_t *rng, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)prng_next(rng) * n) >> 32);
+}
+
+// 0 to 1, excluding 1
+float prng_uniform(Prng_t *rng)
+{
+	return (float)(prng_next(rng) >> 8) / 16777216.0f;
+}
@@ -0,0 +1,325 @@
+// Pseudo-terminal loopback load test for the serial port code
+//
+// Usage: ptyloop [options]
+//
+//   -r rate       samples per second the fake sensor sends (default 100)
+//   -b burst      samples written together in one write() (default 1)
+//   -s secs,ms    every secs seconds, stall the sender for ms milliseconds
+//   -p ms         poll read_serial_data() every ms milliseconds, like the
+//                 GUI timer (default 14); 0 polls continuously with a
+//                 0.2 ms pause
+//   -T secs       test duration (default 10)
+//   -M file       write the pipeline stage statistics to file, in
+//                 Prometheus text format, during and after the run
+//   -J file       record a Chrome trace of the run into file
+//
+// A pty pair stands in for the USB serial device.  open_port() opens the
+// slave side with its normal termios setup and a feeder thread writes a
+// synthetic "Raw:" stream to the master side.  The feeder also decodes the
+// 68 byte packet send_calibration() writes and answers it with the Cal1
+// and Cal2 lines the firmware echoes.  At the end the master is closed, to
+// see how long read_serial_data() takes to notice the device is gone.
+//
+// One JSON object is printed with the sustained throughput, the latency
+// from write() on the master to raw_data() on the host, the calibration
+// round trip and the port close behaviour.
+
+#define _GNU_SOURCE
+#include "imuread.h"
+#include <pthread.h>
+#include <sys/select.h>
+
+#define MAX_SAMPLES (1 << 22)
+
+static int master = -1;
+static float rate = 100.0f;
+static int burst = 1;
+static float stall_every = 0.0f;
+static int stall_ms = 0;
+static int poll_ms = TIMEOUT_MSEC;
+static float duration = 10.0f;
+
+static uint64_t *sent_ns;             // when each sample was written
+static volatile uint32_t sent_count;
+static volatile int feeder_stop;
+static volatile int cal_packets;      // calibration packets received
+static volatile int cal_bad;          // ... with a bad signature or crc
+static uint64_t cal_sent_ns;
+static uint64_t cal_confirmed_ns;
+static uint32_t stalls;
+
+void calibration_confirmed(void)
+{
+	cal_confirmed_ns = monotonic_ns();
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	now = monotonic_ns();
+	if (ns <= now) return;
+	ns -= now;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+static uint16_t crc16(uint16_t crc, uint8_t data)
+{
+	unsigned int i;
+
+	crc ^= data;
+	for (i = 0; i < 8; ++i) {
+		if (crc & 1) {
+			crc = (crc >> 1) ^ 0xA001;
+		} else {
+			crc = (crc >> 1);
+		}
+	}
+	return crc;
+}
+
+static float get_float(const uint8_t *p)
+{
+	union {
+		float f;
+		uint32_t n;
+	} data;
+
+	data.n = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return data.f;
+}
+
+static int put_floats(char *buf, const char *name, const float *f, int n)
+{
+	int i, len;
+
+	len = sprintf(buf, "%s:", name);
+	for (i=0; i < n; i++) {
+		len += sprintf(buf + len, "%s%.5f", i ? "," : "", f[i]);
+	}
+	len += sprintf(buf + len, "\r\n");
+	return len;
+}
+
+// the firmware stores the calibration and echoes it back as Cal1/Cal2
+static int answer_calibration(const uint8_t *packet, char *buf)
+{
+	float cal1[10], cal2[9];
+	uint16_t crc=0xFFFF;
+	int i, len;
+
+	for (i=0; i < 66; i++) {
+		crc = crc16(crc, packet[i]);
+	}
+	if (packet[0] != 117 || packet[1] != 84
+	  || packet[66] != (crc & 255) || packet[67] != (crc >> 8)) {
+		cal_bad++;
+		return 0;
+	}
+	for (i=0; i < 10; i++) {
+		cal1[i] = get_float(packet + 2 + i * 4);
+	}
+	cal2[0] = get_float(packet + 42);       // xx
+	cal2[4] = get_float(packet + 46);       // yy
+	cal2[8] = get_float(packet + 50);       // zz
+	cal2[1] = cal2[3] = get_float(packet + 54); // xy
+	cal2[2] = cal2[6] = get_float(packet + 58); // xz
+	cal2[5] = cal2[7] = get_float(packet + 62); // yz
+	len = put_floats(buf, "Cal1", cal1, 10);
+	len += put_floats(buf + len, "Cal2", cal2, 9);
+	cal_packets++;
+	return len;
+}
+
+// blocks while the pty buffer is full, as a USB device would
+static void write_all(const char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(master, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN && !feeder_stop) {
+			sleep_until(monotonic_ns() + 100000);
+			continue;
+		}
+		if (n <= 0) return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void * feeder(void *arg)
+{
+	SynthConfig_t cfg;
+	int16_t data[9];
+	char buf[256 * 64];
+	uint8_t packet[68];
+	int i, n, len, packetlen=0;
+	uint64_t start, next, stall_at;
+
+	synth_default(&cfg);
+	cfg.rate = rate;
+	synth_init(&cfg);
+	start = next = monotonic_ns();
+	stall_at = stall_every > 0.0f ? start + (uint64_t)(stall_every * 1e9) : 0;
+	while (!feeder_stop) {
+		sleep_until(next);
+		len = 0;
+		for (i=0; i < burst && sent_count + i < MAX_SAMPLES; i++) {
+			synth_sample(data);
+			len += synth_ascii(data, buf + len);
+		}
+		n = i;
+		for (i=0; i < n; i++) {
+			sent_ns[sent_count + i] = monotonic_ns();
+		}
+		sent_count += n;
+		write_all(buf, len);
+		next += (uint64_t)(1e9 * burst / rate);
+
+		// anything from the host is a calibration packet
+		while ((len = read(master, packet + packetlen, 68 - packetlen)) > 0) {
+			packetlen += len;
+			if (packetlen == 68) {
+				len = answer_calibration(packet, buf);
+				if (len > 0) write_all(buf, len);
+				packetlen = 0;
+			}
+		}
+		if (stall_at && monotonic_ns() >= stall_at) {
+			next += (uint64_t)stall_ms * 1000000;
+			stall_at = next + (uint64_t)(stall_every * 1e9);
+			stalls++;
+		}
+	}
+	return NULL;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t thread;
+	struct timeval tv;
+	MagCalSched_t stats;
+	uint64_t start, end, now, *latency;
+	uint64_t closed_ns=0;
+	uint32_t received=0, i, reads=0;
+	long bytes=0;
+	int r, flags, reads_to_close=0, errors=0;
+	const char *slave;
+
+	for (i=1; i < argc; i++) {
+		if (i + 1 >= argc) goto usage;
+		if (strcmp(argv[i], "-r") == 0) rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-b") == 0) burst = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0) {
+			if (sscanf(argv[++i], "%f,%d", &stall_every, &stall_ms) != 2) goto usage;
+		}
+		else if (strcmp(argv[i], "-p") == 0) poll_ms = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-T") == 0) duration = atof(argv[++i]);
+		else if (strcmp(argv[i], "-M") == 0) stats_set_dump_path(argv[++i]);
+		else if (strcmp(argv[i], "-J") == 0) trace_start(argv[++i]);
+		else goto usage;
+	}
+	if (rate <= 0.0f || burst < 1 || burst > 64 || poll_ms < 0) goto usage;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		fprintf(stderr, "ptyloop: unable to create a pty\n");
+		return 1;
+	}
+	slave = ptsname(master);
+	if (!open_port(slave)) {
+		fprintf(stderr, "ptyloop: open_port(%s) failed\n", slave);
+		return 1;
+	}
+	flags = fcntl(master, F_GETFL);
+	fcntl(master, F_SETFL, flags | O_NONBLOCK);
+	sent_ns = malloc(MAX_SAMPLES * sizeof(uint64_t));
+	latency = malloc(MAX_SAMPLES * sizeof(uint64_t));
+	if (!sent_ns || !latency) return 1;
+	raw_data_set_rate(rate, OVERSAMPLE_RATIO);
+	stats_reset();
+	pthread_create(&thread, NULL, feeder, NULL);
+
+	start = monotonic_ns();
+	end = start + (uint64_t)(duration * 1e9);
+	while ((now = monotonic_ns()) < end) {
+		if (poll_ms > 0) {
+			sleep_until(now + (uint64_t)poll_ms * 1000000);
+		} else {
+			tv.tv_sec = 0;
+			tv.tv_usec = 200;
+			select(0, NULL, NULL, NULL, &tv);
+		}
+		r = read_serial_data();
+		if (r < 0) {
+			errors++;
+			break;
+		}
+		// stands in for the redraw the GUI timer asks for after each poll
+		stats_frame_shown(current_orientation_time.host_ns);
+		stats_poll();
+		if (r > 0) {
+			bytes += r;
+			reads++;
+		}
+		// match each newly parsed sample with the time it was written
+		magcal_sched_stats(&stats);
+		now = monotonic_ns();
+		while (received < stats.samples && received < sent_count) {
+			latency[received] = now - sent_ns[received];
+			received++;
+		}
+		if (!cal_sent_ns && magcal.ValidMagCal) {
+			cal_sent_ns = monotonic_ns();
+			send_calibration();
+		}
+	}
+	feeder_stop = 1;
+	pthread_join(thread, NULL);
+	for (i=1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-M") == 0) stats_dump(argv[i + 1]);
+	}
+	trace_write(NULL);
+
+	// the device is unplugged: how many polls until the port is closed?
+	close(master);
+	now = monotonic_ns();
+	while (port_is_open() && reads_to_close < 1000) {
+		reads_to_close++;
+		if (read_serial_data() < 0) break;
+	}
+	if (!port_is_open()) closed_ns = monotonic_ns() - now;
+
+	qsort(latency, received, sizeof(uint64_t), compare_ns);
+	printf("{\"rate\":%.0f,\"burst\":%d,\"poll_ms\":%d,\"stalls\":%u,"
+		"\"sent\":%u,\"received\":%u,\"samples_per_sec\":%.1f,"
+		"\"bytes_per_sec\":%.0f,\"bytes_per_read\":%.1f,\"read_errors\":%d,"
+		"\"latency_ms_p50\":%.3f,\"latency_ms_p99\":%.3f,\"latency_ms_max\":%.3f,"
+		"\"cal_packets\":%d,\"cal_bad\":%d,\"cal_roundtrip_ms\":%.3f,"
+		"\"reads_to_close\":%d,\"close_ms\":%.3f}\n",
+		rate, burst, poll_ms, stalls, sent_count, received,
+		received / duration, bytes / duration,
+		reads ? (double)bytes / reads : 0.0, errors,
+		received ? latency[received / 2] * 1e-6 : -1.0,
+		received ? latency[received - 1 - received / 100] * 1e-6 : -1.0,
+		received ? latency[received - 1] * 1e-6 : -1.0,
+		cal_packets, cal_bad,
+		cal_confirmed_ns ? (cal_confirmed_ns - cal_sent_ns) * 1e-6 : -1.0,
+		reads_to_close, port_is_open() ? -1.0 : closed_ns * 1e-6);
+	return 0;
+usage:
+	fprintf(stderr, "Usage: ptyloop [-r rate] [-b burst] [-s secs,ms] "
+		"[-p poll_ms] [-T secs] [-M file] [-J file]\n");
+	return 1;
+}
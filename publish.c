@@ -0,0 +1,228 @@
+#include "imuread.h"
+#if defined(LINUX) || defined(MACOSX)
+#include <sys/mman.h>
+#include <signal.h>
+#endif
+
+// Live output for other processes on the same host.  Every sample is
+// published, calibrated, with the orientation as of that sample, into a
+// ring in POSIX shared memory.  There is one writer, this process, and
+// any number of readers, which map the ring read only and never make the
+// writer wait: a reader that falls more than a ring behind finds its
+// next record overwritten, counts the records it lost and carries on
+// half a ring behind the writer.
+//
+// Each slot is a seqlock.  Record n goes in slot n % PUBLISH_SLOTS, and
+// the slot's sequence number is 2n+1 while it's being written and 2n+2
+// once it's complete.  A reader copies the slot out between two reads
+// of the sequence number; the copy is good if both read 2n+2.  Reading
+// takes no system calls, so readers poll, see publish_next(); only a
+// reader that has caught up checks, with kill(), that the writer lives.
+
+#define PUBLISH_MAGIC    "MCPUB\r\n\032"
+#define PUBLISH_VERSION  1
+#define PUBLISH_SLOTS    4096       // power of 2, 40 s at 100 Hz
+
+typedef struct {
+	volatile uint64_t seq;
+	PublishRecord_t rec;
+} PublishSlot_t;
+
+typedef struct {
+	char magic[8];               // written last, once the rest is valid
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t slots;
+	uint32_t oversample;
+	float rate;
+	uint32_t pid;                // the writer
+	volatile uint32_t closed;    // 1 = the writer has stopped
+	uint8_t pad1[28];
+	volatile uint64_t head;      // records published, on its own cache line
+	uint8_t pad2[56];
+} PublishHeader_t;
+
+#define PUBLISH_SIZE (sizeof(PublishHeader_t) + PUBLISH_SLOTS * sizeof(PublishSlot_t))
+
+#if defined(LINUX) || defined(MACOSX)
+
+static PublishHeader_t *hdr=NULL;
+static PublishSlot_t *ring;
+static char shm_name[256];
+
+// shm_open() names are "/name"
+static void make_name(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+// Returns 1 if publishing started.  name NULL means MOTIONCAL_PUBLISH, if
+// set.
+int publish_start(const char *name)
+{
+	void *p;
+	int fd;
+
+	if (name == NULL) name = getenv("MOTIONCAL_PUBLISH");
+	if (name == NULL || *name == 0) return 0;
+	publish_stop();
+	make_name(shm_name, sizeof(shm_name), name);
+	// a fresh segment, so readers of a previous run see it closed
+	shm_unlink(shm_name);
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return 0;
+	if (ftruncate(fd, PUBLISH_SIZE) != 0) {
+		close(fd);
+		shm_unlink(shm_name);
+		return 0;
+	}
+	p = mmap(NULL, PUBLISH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(shm_name);
+		return 0;
+	}
+	hdr = (PublishHeader_t *)p;
+	ring = (PublishSlot_t *)(hdr + 1);
+	hdr->version = PUBLISH_VERSION;
+	hdr->slot_size = sizeof(PublishSlot_t);
+	hdr->slots = PUBLISH_SLOTS;
+	hdr->oversample = raw_data_oversample();
+	hdr->rate = raw_data_rate();
+	hdr->pid = getpid();
+	__sync_synchronize();
+	memcpy(hdr->magic, PUBLISH_MAGIC, 8);
+	return 1;
+}
+
+int publish_active(void)
+{
+	return hdr != NULL;
+}
+
+void publish_sample(const int16_t *data, const SampleTime_t *time,
+	const Point_t *mag, uint32_t generation)
+{
+	PublishSlot_t *slot;
+	PublishRecord_t *rec;
+	uint64_t n;
+
+	if (hdr == NULL) return;
+	n = hdr->head;
+	slot = ring + (n & (PUBLISH_SLOTS - 1));
+	rec = &slot->rec;
+	slot->seq = 2 * n + 1;
+	__sync_synchronize();
+	rec->sample = n;
+	rec->host_ns = (time && time->host_ns) ? time->host_ns : monotonic_ns();
+	rec->sensor_us = time ? time->sensor_us : 0;
+	rec->has_sensor_us = time ? time->has_sensor_us : 0;
+	rec->generation = generation;
+	rec->mag[0] = mag->x;
+	rec->mag[1] = mag->y;
+	rec->mag[2] = mag->z;
+	rec->accel[0] = (float)data[0] * G_PER_COUNT;
+	rec->accel[1] = (float)data[1] * G_PER_COUNT;
+	rec->accel[2] = (float)data[2] * G_PER_COUNT;
+	rec->gyro[0] = (float)data[3] * DEG_PER_SEC_PER_COUNT;
+	rec->gyro[1] = (float)data[4] * DEG_PER_SEC_PER_COUNT;
+	rec->gyro[2] = (float)data[5] * DEG_PER_SEC_PER_COUNT;
+	rec->q = current_orientation;
+	__sync_synchronize();
+	slot->seq = 2 * n + 2;
+	hdr->head = n + 1;
+}
+
+void publish_stop(void)
+{
+	if (hdr == NULL) return;
+	hdr->closed = 1;
+	munmap(hdr, PUBLISH_SIZE);
+	shm_unlink(shm_name);
+	hdr = NULL;
+}
+
+// Returns 0 if there's no ring called name.  The reader starts with the
+// next record published.
+int publish_open(PublishReader_t *r, const char *name)
+{
+	PublishHeader_t *h;
+	char buf[256];
+	void *p;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	make_name(buf, sizeof(buf), name);
+	fd = shm_open(buf, O_RDONLY, 0);
+	if (fd < 0) return 0;
+	p = mmap(NULL, PUBLISH_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return 0;
+	h = (PublishHeader_t *)p;
+	if (memcmp(h->magic, PUBLISH_MAGIC, 8) != 0 || h->version != PUBLISH_VERSION
+	  || h->slot_size != sizeof(PublishSlot_t) || h->slots != PUBLISH_SLOTS) {
+		munmap(p, PUBLISH_SIZE);
+		return 0;
+	}
+	__sync_synchronize();
+	r->base = p;
+	r->rate = h->rate;
+	r->oversample = h->oversample;
+	r->pid = h->pid;
+	r->next = h->head;
+	return 1;
+}
+
+// Returns 1 with the next record, 0 if it isn't published yet,
+// PUBLISH_LOST if the writer overwrote it (r->lost counts the records
+// skipped, and the next call continues half a ring behind the writer) or
+// PUBLISH_CLOSED once the writer has stopped, or died without saying
+// so, and every record is read.
+int publish_next(PublishReader_t *r, PublishRecord_t *rec)
+{
+	const PublishHeader_t *h = (const PublishHeader_t *)r->base;
+	const PublishSlot_t *slot;
+	uint64_t n = r->next, seq, head;
+
+	slot = (const PublishSlot_t *)(h + 1) + (n & (PUBLISH_SLOTS - 1));
+	seq = slot->seq;
+	__sync_synchronize();
+	if (seq == 2 * n + 2) {
+		memcpy(rec, (const void *)&slot->rec, sizeof(*rec));
+		__sync_synchronize();
+		if (slot->seq == seq) {
+			r->next = n + 1;
+			return 1;
+		}
+	} else if (seq < 2 * n + 2) {
+		if (h->head > n) return 0;
+		if (h->closed || (kill(r->pid, 0) != 0 && errno == ESRCH)) return PUBLISH_CLOSED;
+		return 0;
+	}
+	// the oldest records are the next to go, so skip to where there's room
+	head = h->head - PUBLISH_SLOTS / 2;
+	if (head < n) head = n + 1;
+	r->lost += head - n;
+	r->next = head;
+	return PUBLISH_LOST;
+}
+
+void publish_close(PublishReader_t *r)
+{
+	if (r->base) munmap(r->base, PUBLISH_SIZE);
+	r->base = NULL;
+}
+
+#else
+
+// no POSIX shared memory
+int publish_start(const char *name) { return 0; }
+int publish_active(void) { return 0; }
+void publish_sample(const int16_t *data, const SampleTime_t *time,
+	const Point_t *mag, uint32_t generation) { }
+void publish_stop(void) { }
+int publish_open(PublishReader_t *r, const char *name) { memset(r, 0, sizeof(*r)); return 0; }
+int publish_next(PublishReader_t *r, PublishRecord_t *rec) { return PUBLISH_CLOSED; }
+void publish_close(PublishReader_t *r) { }
+
+#endif
@@ -58,6 +58,11 @@ static int sphere_region(float x, float y, float z)
 	return region;
 }
 
+// which of the 100 sphere regions a calibrated point falls in
+int quality_sphere_region(const Point_t *point)
+{
+	return sphere_region(point->x, point->y, point->z);
+}
 
 static int count=0;
 static int spheredist[100];
@@ -146,6 +151,23 @@ void quality_update(const Point_t *point)
 	quality_wobble_computed = 0;
 }
 
+// recompute the metrics from the current buffer and calibration,
+// as the display does while drawing the points
+void quality_refresh(void)
+{
+	Point_t point;
+	int i;
+
+	quality_reset();
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (magcal.valid[i]) {
+			apply_calibration(magcal.BpFast[0][i], magcal.BpFast[1][i],
+				magcal.BpFast[2][i], &point);
+			quality_update(&point);
+		}
+	}
+}
+
 // How many surface gaps
 float quality_surface_gap_error(void)
 {
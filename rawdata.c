@@ -1,17 +1,66 @@
 #include "imuread.h"
 
+Quaternion_t current_orientation;
+SampleTime_t current_orientation_time;
 
+
+static float sample_rate=SENSORFS;
+static int oversample=OVERSAMPLE_RATIO;
 static int rawcount=OVERSAMPLE_RATIO;
+static int magcal_decimate=1;  // raw samples per calibration buffer sample
+static int magcal_phase=0;
+static uint64_t magcal_seed=1; // same eviction choices every session, by default
 static AccelSensor_t accel;
 static MagSensor_t   mag;
 static GyroSensor_t  gyro;
 
+// measured sample intervals
+#define DT_MIN_RATIO 0.25f     // clamp measured dt to this range of nominal,
+#define DT_MAX_RATIO 4.0f      // so gaps and clock resets can't upset fusion
+#define DT_HOST_SMOOTHING 0.05f
+static SampleTime_t last_time;
+static uint64_t batch_ns;      // host time of the current read
+static uint32_t batch_samples; // samples since the previous read
+static float host_dt;          // smoothed host-derived interval (s)
+static SampleJitter_t jitter_sensor, jitter_host;
+static double jitter_sum[2], jitter_sumsq[2];
+
+// novelty gate: readings this close to one already buffered add nothing
+// to the fit, so they are dropped before any eviction work is done
+#define NOVELTY_DEFAULT_UT 1.0f
+#define NOVELTY_BUCKETS 1024   // power of 2
+static int32_t novelty_dist=(int32_t)(NOVELTY_DEFAULT_UT / UT_PER_COUNT + 0.5f);
+static int16_t novelty_head[NOVELTY_BUCKETS];  // first slot in each bucket, -1 = none
+static int16_t novelty_next[MAGBUFFSIZE];      // next slot in the same bucket
+static int16_t novelty_bucket[MAGBUFFSIZE];    // bucket each slot is filed in, -1 = none
+static uint32_t novelty_admitted, novelty_rejected;
+
 static float cal_data_sent[19];
 static int cal_confirm_needed=0;
 
+static void novelty_reset(void)
+{
+	memset(novelty_head, 0xFF, sizeof(novelty_head));
+	memset(novelty_bucket, 0xFF, sizeof(novelty_bucket));
+	novelty_admitted = 0;
+	novelty_rejected = 0;
+}
+
 void raw_data_reset(void)
 {
-	rawcount = OVERSAMPLE_RATIO;
+	rawcount = oversample;
+	magcal_phase = 0;
+	novelty_reset();
+	retention_reset();
+	quality_reset();  // the classic policy reads the metrics, don't leave stale ones
+	memset(&last_time, 0, sizeof(last_time));
+	batch_ns = 0;
+	batch_samples = 0;
+	host_dt = 1.0f / sample_rate;
+	memset(&jitter_sensor, 0, sizeof(jitter_sensor));
+	memset(&jitter_host, 0, sizeof(jitter_host));
+	memset(jitter_sum, 0, sizeof(jitter_sum));
+	memset(jitter_sumsq, 0, sizeof(jitter_sumsq));
 	fusion_init();
 	memset(&magcal, 0, sizeof(magcal));
 	magcal.V[2] = 80.0f;  // initial guess
@@ -21,106 +70,207 @@ void raw_data_reset(void)
 	magcal.FitError = 100.0f;
 	magcal.FitErrorAge = 100.0f;
 	magcal.B = 50.0f;
+	prng_seed(&magcal.rng, magcal_seed);
+	magcal_sched_reset();
 }
 
-static int choose_discard_magcal(void)
+// Sensors faster than SENSORFS give the calibration buffer only every
+// Nth reading, so it fills and evicts at the pace its discard policy was
+// designed for, rather than with near duplicates of the same few degrees
+// of rotation.  Resets the buffer, fusion and calibration at once.
+int raw_data_set_rate(float rate, int oversample_ratio)
 {
-	int32_t rawx, rawy, rawz;
-	int32_t dx, dy, dz;
-	float x, y, z;
-	uint64_t distsq, minsum=0xFFFFFFFFFFFFFFFFull;
-	static int runcount=0;
-	int i, j, minindex=0;
-	Point_t point;
-	float gaps, field, error, errormax;
-
-	// When enough data is collected (gaps error is low), assume we
-	// have a pretty good coverage and the field stregth is known.
-	gaps = quality_surface_gap_error();
-	if (gaps < 25.0f) {
-		// occasionally look for points farthest from average field strength
-		// always rate limit assumption-based data purging, but allow the
-		// rate to increase as the angular coverage improves.
-		if (gaps < 1.0f) gaps = 1.0f;
-		if (++runcount > (int)(gaps * 10.0f)) {
-			j = MAGBUFFSIZE;
-			errormax = 0.0f;
-			for (i=0; i < MAGBUFFSIZE; i++) {
-				rawx = magcal.BpFast[0][i];
-				rawy = magcal.BpFast[1][i];
-				rawz = magcal.BpFast[2][i];
-				apply_calibration(rawx, rawy, rawz, &point);
-				x = point.x;
-				y = point.y;
-				z = point.z;
-				field = sqrtf(x * x + y * y + z * z);
-				// if magcal.B is bad, things could go horribly wrong
-				error = fabsf(field - magcal.B);
-				if (error > errormax) {
-					errormax = error;
-					j = i;
+	if (rate <= 0.0f || oversample_ratio < 1 || oversample_ratio > OVERSAMPLE_MAX)
+		return 0;
+	sample_rate = rate;
+	oversample = oversample_ratio;
+	magcal_decimate = (int)(rate / (float)SENSORFS + 0.5f);
+	if (magcal_decimate < 1) magcal_decimate = 1;
+	raw_data_reset();
+	return 1;
+}
+
+// Seed for the calibration's random choices.  Resets at once, reseeding
+// as it does, so a replay started right after is repeated bit for bit.
+void raw_data_set_seed(uint64_t seed)
+{
+	magcal_seed = seed;
+	raw_data_reset();
+}
+
+float raw_data_rate(void)
+{
+	return sample_rate;
+}
+
+int raw_data_oversample(void)
+{
+	return oversample;
+}
+
+// Minimum distance between buffered readings, in uT.  0 admits every
+// reading.  Resets the buffer, fusion and calibration at once.
+void raw_data_set_novelty(float ut)
+{
+	if (ut < 0.0f) ut = 0.0f;
+	novelty_dist = (int32_t)(ut / UT_PER_COUNT + 0.5f);
+	raw_data_reset();
+}
+
+float raw_data_get_novelty(void)
+{
+	return (float)novelty_dist * UT_PER_COUNT;
+}
+
+void raw_data_novelty_stats(uint32_t *admitted, uint32_t *rejected)
+{
+	*admitted = novelty_admitted;
+	*rejected = novelty_rejected;
+}
+
+// The grid cells are novelty_dist on a side, so any buffered reading
+// within novelty_dist is filed in one of the 27 cells around the new one.
+static int novelty_hash(int32_t cx, int32_t cy, int32_t cz)
+{
+	return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u
+		^ (uint32_t)cz * 83492791u) & (NOVELTY_BUCKETS - 1);
+}
+
+static int32_t novelty_cell(int16_t n)
+{
+	// floor division, so cells don't double in size around zero
+	return (n >= 0) ? n / novelty_dist : -((novelty_dist - 1 - n) / novelty_dist);
+}
+
+static int novelty_is_redundant(const int16_t *data)
+{
+	int32_t cx, cy, cz, dx, dy, dz, limit;
+	int i, j, k, slot;
+
+	cx = novelty_cell(data[6]);
+	cy = novelty_cell(data[7]);
+	cz = novelty_cell(data[8]);
+	limit = novelty_dist * novelty_dist;
+	for (i=-1; i <= 1; i++) {
+		for (j=-1; j <= 1; j++) {
+			for (k=-1; k <= 1; k++) {
+				slot = novelty_head[novelty_hash(cx+i, cy+j, cz+k)];
+				for (; slot >= 0; slot = novelty_next[slot]) {
+					// the solvers may have dropped it as an outlier since
+					if (!magcal.valid[slot]) continue;
+					dx = magcal.BpFast[0][slot] - data[6];
+					dy = magcal.BpFast[1][slot] - data[7];
+					dz = magcal.BpFast[2][slot] - data[8];
+					// up to 3 * 65535^2, too big for an int
+					if ((int64_t)dx * dx + (int64_t)dy * dy + (int64_t)dz * dz < limit) return 1;
 				}
 			}
-			runcount = 0;
-			if (j < MAGBUFFSIZE) {
-				//printf("worst error at %d\n", j);
-				return j;
-			}
 		}
-	} else {
-		runcount = 0;
 	}
-	// When solid info isn't availabe, find 2 points closest to each other,
-	// and randomly discard one.  When we don't have good coverage, this
-	// approach tends to add points into previously unmeasured areas while
-	// discarding info from areas with highly redundant info.
-	for (i=0; i < MAGBUFFSIZE; i++) {
-		for (j=i+1; j < MAGBUFFSIZE; j++) {
-			dx = magcal.BpFast[0][i] - magcal.BpFast[0][j];
-			dy = magcal.BpFast[1][i] - magcal.BpFast[1][j];
-			dz = magcal.BpFast[2][i] - magcal.BpFast[2][j];
-			distsq = (int64_t)dx * (int64_t)dx;
-			distsq += (int64_t)dy * (int64_t)dy;
-			distsq += (int64_t)dz * (int64_t)dz;
-			if (distsq < minsum) {
-				minsum = distsq;
-				minindex = (random() & 1) ? i : j;
+	return 0;
+}
+
+static void novelty_file(int slot)
+{
+	int16_t *p;
+	int bucket;
+
+	bucket = novelty_bucket[slot];
+	if (bucket >= 0) {
+		for (p = &novelty_head[bucket]; *p >= 0; p = &novelty_next[*p]) {
+			if (*p == slot) {
+				*p = novelty_next[slot];
+				break;
 			}
 		}
 	}
-	return minindex;
+	bucket = novelty_hash(novelty_cell(magcal.BpFast[0][slot]),
+		novelty_cell(magcal.BpFast[1][slot]), novelty_cell(magcal.BpFast[2][slot]));
+	novelty_next[slot] = novelty_head[bucket];
+	novelty_head[bucket] = slot;
+	novelty_bucket[slot] = bucket;
 }
 
-
 static void add_magcal_data(const int16_t *data)
 {
-	int i;
+	int i, evicted=0;
 
+	magcal_continuous_add(data[6], data[7], data[8]);
+	if (++magcal_phase < magcal_decimate) return;
+	magcal_phase = 0;
+	magcal_warm_reading(data[6], data[7], data[8]);
+	if (novelty_dist > 0) {
+		if (novelty_is_redundant(data)) {
+			novelty_rejected++;
+			return;
+		}
+		novelty_admitted++;
+	}
 	// first look for an unused caldata slot
 	for (i=0; i < MAGBUFFSIZE; i++) {
 		if (!magcal.valid[i]) break;
 	}
-	// If the buffer is full, we must choose which old data to discard.
-	// We must choose wisely!  Throwing away the wrong data could prevent
-	// collecting enough data distributed across the entire 3D angular
-	// range, preventing a decent cal from ever happening at all.  Making
-	// any assumption about good vs bad data is particularly risky,
-	// because being wrong could cause an unstable feedback loop where
-	// bad data leads to wrong decisions which leads to even worse data.
-	// But if done well, purging bad data has massive potential to
-	// improve results.  The trick is telling the good from the bad while
-	// still in the process of learning what's good...
+	// If the buffer is full, the retention policy chooses which old
+	// data to discard, or to discard the new reading.
 	if (i >= MAGBUFFSIZE) {
-		i = choose_discard_magcal();
-		if (i < 0 || i >= MAGBUFFSIZE) {
-			i = random() % MAGBUFFSIZE;
-		}
+		STAT_BEGIN(STAT_EVICT);
+		TRACE_BEGIN();
+		i = retention_choose(data);
+		TRACE_END("evict", i);
+		STAT_END(STAT_EVICT);
+		if (i < 0) return;
+		if (i >= MAGBUFFSIZE) i = prng_below(&magcal.rng, MAGBUFFSIZE);
+		evicted = 1;
 	}
 	// add it to the cal buffer
 	magcal.BpFast[0][i] = data[6];
 	magcal.BpFast[1][i] = data[7];
 	magcal.BpFast[2][i] = data[8];
 	magcal.valid[i] = 1;
+	retention_added(i);
+	if (novelty_dist > 0) novelty_file(i);
+	magcal_sched_changed(i, evicted);
+}
+
+void raw_data_snapshot(MagCalSnapshot_t *snap)
+{
+	memset(snap, 0, sizeof(*snap));  // padding too, so snapshots compare
+	memcpy(snap->V, magcal.V, sizeof(snap->V));
+	memcpy(snap->invW, magcal.invW, sizeof(snap->invW));
+	snap->B = magcal.B;
+	snap->FitError = magcal.FitError;
+	snap->ValidMagCal = magcal.ValidMagCal;
+	memcpy(snap->BpFast, magcal.BpFast, sizeof(snap->BpFast));
+	memcpy(snap->valid, magcal.valid, sizeof(snap->valid));
+}
+
+// Reset, then carry on from a saved calibration and buffer rather than
+// from nothing.  The retention policy and scheduler see the buffered
+// readings as if they had just arrived.
+void raw_data_restore(const MagCalSnapshot_t *snap)
+{
+	int i;
+
+	raw_data_reset();
+	memcpy(magcal.V, snap->V, sizeof(magcal.V));
+	memcpy(magcal.invW, snap->invW, sizeof(magcal.invW));
+	magcal.B = snap->B;
+	magcal.FourBsq = 4.0f * snap->B * snap->B;
+	magcal.ValidMagCal = snap->ValidMagCal;
+	if (magcal.ValidMagCal) {
+		magcal.FitError = snap->FitError;
+		magcal.FitErrorAge = (snap->FitError > 2.0f) ? snap->FitError : 2.0f;
+	}
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (!snap->valid[i]) continue;
+		magcal.BpFast[0][i] = snap->BpFast[0][i];
+		magcal.BpFast[1][i] = snap->BpFast[1][i];
+		magcal.BpFast[2][i] = snap->BpFast[2][i];
+		magcal.valid[i] = 1;
+		retention_added(i);
+		if (novelty_dist > 0) novelty_file(i);
+		magcal_sched_changed(i, 0);
+	}
 }
 
 static int is_float_ok(float actual, float expected)
@@ -155,6 +305,7 @@ void cal1_data(const float *data)
 		}
 		if (ok) {
 			cal_confirm_needed &= ~1; // got cal1 confirm
+			recording_event(REC_CONFIRM, 1);
 			if (cal_confirm_needed == 0) {
 				calibration_confirmed();
 			}
@@ -184,6 +335,7 @@ void cal2_data(const float *data)
 		}
 		if (ok) {
 			cal_confirm_needed &= ~2; // got cal2 confirm
+			recording_event(REC_CONFIRM, 2);
 			if (cal_confirm_needed == 0) {
 				calibration_confirmed();
 			}
@@ -191,17 +343,97 @@ void cal2_data(const float *data)
 	}
 }
 
+static void jitter_add(SampleJitter_t *j, double *sum, double *sumsq, float us)
+{
+	float mean;
+	int bin;
+
+	bin = (int)(us * sample_rate * 4.0e-6f);
+	if (bin < 0) bin = 0;
+	if (bin >= JITTER_BINS) bin = JITTER_BINS - 1;
+	j->bins[bin]++;
+	if (j->count == 0 || us < j->min_us) j->min_us = us;
+	if (j->count == 0 || us > j->max_us) j->max_us = us;
+	j->count++;
+	*sum += us;
+	*sumsq += (double)us * us;
+	mean = *sum / j->count;
+	j->mean_us = mean;
+	j->stddev_us = sqrtf(fmaxf(*sumsq / j->count - (double)mean * mean, 0.0f));
+}
+
+void raw_data_jitter(SampleJitter_t *sensor, SampleJitter_t *host)
+{
+	if (sensor) *sensor = jitter_sensor;
+	if (host) *host = jitter_host;
+}
+
+// The interval this sample ends.  The sensor's own clock is exact when it
+// is sent.  Host read times come in batches (USB packets, timer ticks), so
+// they are only used averaged over whole reads, to follow the true rate.
+static float sample_dt(const SampleTime_t *time)
+{
+	float nominal, dt, us;
+
+	nominal = 1.0f / sample_rate;
+	dt = nominal;
+	if (time == NULL) return dt;
+	if (time->host_ns) {
+		if (last_time.host_ns) {
+			us = (float)(time->host_ns - last_time.host_ns) * 0.001f;
+			jitter_add(&jitter_host, &jitter_sum[0], &jitter_sumsq[0], us);
+		}
+		if (time->host_ns != batch_ns) {
+			if (batch_ns && batch_samples) {
+				dt = (float)(time->host_ns - batch_ns) * 1.0e-9f / batch_samples;
+				if (dt > nominal * DT_MIN_RATIO && dt < nominal * DT_MAX_RATIO) {
+					host_dt += (dt - host_dt) * DT_HOST_SMOOTHING;
+				}
+			}
+			batch_ns = time->host_ns;
+			batch_samples = 0;
+		}
+		batch_samples++;
+		dt = host_dt;
+	}
+	if (time->has_sensor_us && last_time.has_sensor_us) {
+		// unsigned subtraction handles the 32 bit clock wrapping
+		us = (float)(uint32_t)(time->sensor_us - last_time.sensor_us);
+		jitter_add(&jitter_sensor, &jitter_sum[1], &jitter_sumsq[1], us);
+		dt = us * 1.0e-6f;
+	}
+	last_time = *time;
+	if (dt < nominal * DT_MIN_RATIO) dt = nominal * DT_MIN_RATIO;
+	if (dt > nominal * DT_MAX_RATIO) dt = nominal * DT_MAX_RATIO;
+	return dt;
+}
+
 void raw_data(const int16_t *data)
+{
+	raw_data_timed(data, NULL);
+}
+
+void raw_data_timed(const int16_t *data, const SampleTime_t *time)
 {
 	static int force_orientation_counter=0;
-	float x, y, z, ratio, magdiff;
+	float x, y, z, ratio, magdiff, dt;
 	Point_t point;
+	int solved;
 
+	STAT_BEGIN(STAT_RAWDATA);
+	STAT_ADD(STAT_SAMPLES, 1);
+	recording_sample(data, time);
+	dt = sample_dt(time);
+	STAT_BEGIN(STAT_ADDMAG);
 	add_magcal_data(data);
+	STAT_END(STAT_ADDMAG);
 	x = magcal.V[0];
 	y = magcal.V[1];
 	z = magcal.V[2];
-	if (MagCal_Run()) {
+	STAT_BEGIN(STAT_SOLVE);
+	solved = MagCal_Run();
+	STAT_END(STAT_SOLVE);
+	if (solved) {
 		x -= magcal.V[0];
 		y -= magcal.V[1];
 		z -= magcal.V[2];
@@ -209,7 +441,7 @@ void raw_data(const int16_t *data)
 		//printf("magdiff = %.2f\n", magdiff);
 		if (magdiff > 0.8f) {
 			fusion_init();
-			rawcount = OVERSAMPLE_RATIO;
+			rawcount = oversample;
 			force_orientation_counter = 240;
 		}
 	}
@@ -218,11 +450,11 @@ void raw_data(const int16_t *data)
 		if (--force_orientation_counter == 0) {
 			//printf("delayed forcible orientation reset\n");
 			fusion_init();
-			rawcount = OVERSAMPLE_RATIO;
+			rawcount = oversample;
 		}
 	}
 
-	if (rawcount >= OVERSAMPLE_RATIO) {
+	if (rawcount >= oversample) {
 		memset(&accel, 0, sizeof(accel));
 		memset(&mag, 0, sizeof(mag));
 		memset(&gyro, 0, sizeof(gyro));
@@ -247,6 +479,7 @@ void raw_data(const int16_t *data)
 	gyro.YpFast[rawcount][0] = x;
 	gyro.YpFast[rawcount][1] = y;
 	gyro.YpFast[rawcount][2] = z;
+	gyro.dtFast[rawcount] = dt;
 
 	apply_calibration(data[6], data[7], data[8], &point);
 	mag.BcFast[0] = point.x;
@@ -257,8 +490,8 @@ void raw_data(const int16_t *data)
 	mag.Bc[2] += point.z;
 
 	rawcount++;
-	if (rawcount >= OVERSAMPLE_RATIO) {
-		ratio = 1.0f / (float)OVERSAMPLE_RATIO;
+	if (rawcount >= oversample) {
+		ratio = 1.0f / (float)oversample;
 		accel.Gp[0] *= ratio;
 		accel.Gp[1] *= ratio;
 		accel.Gp[2] *= ratio;
@@ -268,9 +501,16 @@ void raw_data(const int16_t *data)
 		mag.Bc[0] *= ratio;
 		mag.Bc[1] *= ratio;
 		mag.Bc[2] *= ratio;
+		STAT_BEGIN(STAT_FUSION);
+		TRACE_BEGIN();
 		fusion_update(&accel, &mag, &gyro, &magcal);
+		TRACE_END("fusion", oversample);
+		STAT_END(STAT_FUSION);
 		fusion_read(&current_orientation);
+		if (time) current_orientation_time = *time;
 	}
+	publish_sample(data, time, &point, magcal_generation());
+	STAT_END(STAT_RAWDATA);
 }
 
 static uint16_t crc16(uint16_t crc, uint8_t data)
@@ -342,6 +582,7 @@ int send_calibration(void)
 	cal_data_sent[17] = magcal.invW[2][1];
 	cal_data_sent[18] = magcal.invW[2][2];
 	cal_confirm_needed = 3;
+	recording_event(REC_SENDCAL, 0);
 	crc = 0xFFFF;
 	for (i=0; i < 66; i++) {
 		crc = crc16(crc, buf[i]);
@@ -0,0 +1,629 @@
+#include "imuread.h"
+#if defined(LINUX) || defined(MACOSX)
+#include <sys/mman.h>
+#elif defined(WINDOWS)
+#include <io.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Session recordings.  Replaying hours of "Raw:" text means parsing it
+// all again, and finding minute 40 means reading the first 39.  Here the
+// samples are stored as differences from the previous sample, zigzag and
+// varint coded, in fixed size blocks that each decode on their own.  An
+// index of the blocks follows the last one, so a reader maps the file,
+// finds the block for any time with a binary search of the index, and
+// decodes from there.
+//
+// File:   header, blocks, index entries, trailer.  All little endian.
+// Header: "MCREC\r\n\032", block size, sample rate, oversample ratio.
+// Block:  "MCBK", bytes used, records, samples before the block, host
+//         and sensor time the deltas start from, samples in the block,
+//         host time of its first sample, then the records, zero padded.
+// Record: a tag byte, the REC_* type in the low 3 bits.
+//   REC_SAMPLE    host ns delta (zigzag), sensor us delta (zigzag, when
+//                 REC_SENSOR_US is set), then the 9 readings (zigzag)
+//   REC_ACCEPT,   V, invW, B, fit error (14 floats) and the solver
+//   REC_SENDCAL
+//   REC_CONFIRM   1 for Cal1, 2 for Cal2
+//   REC_SNAPSHOT  the calibration, then the buffered readings: count,
+//                 then slot gap (varint) and xyz deltas (zigzag) of each
+// Index:  per block, host time of its first sample, samples before it,
+//         samples in it.  Trailer: index offset, block count, "MCIX".
+//
+// Every block starts with a snapshot of the calibration buffer, so a
+// replay that seeks can start with the buffer the session had there.  A
+// recording cut short, without the index, is read by scanning the block
+// headers instead.
+
+#define REC_MAGIC         "MCREC\r\n\032"
+#define REC_HEADER_SIZE   32
+#define REC_BLOCK_SIZE    65536
+#define REC_BLOCK_HEADER  40
+#define REC_INDEX_ENTRY   16
+#define REC_TRAILER_SIZE  16
+#define REC_MAX_SAMPLE    48      // largest sample record
+#define REC_SENSOR_US     0x08    // tag flags
+#define REC_NO_TIME       0x10
+
+static FILE *rec_fp;
+static uint8_t block[REC_BLOCK_SIZE];
+static uint32_t used;               // bytes of block used, 0 = not started
+static uint32_t block_records;
+static uint32_t block_samples;
+static uint32_t block_first_sample;
+static uint64_t block_first_ns;
+static uint32_t rec_samples;        // samples recorded
+static int16_t prev[9];
+static uint64_t prev_ns;
+static uint32_t prev_us;
+static uint8_t *rec_index;
+static uint32_t nblocks, index_alloc;
+static int index_lost;              // out of memory, the recording has no index
+static uint64_t rec_offset;         // bytes written
+
+static void put_u32(uint8_t *p, uint32_t n)
+{
+	p[0] = n;
+	p[1] = n >> 8;
+	p[2] = n >> 16;
+	p[3] = n >> 24;
+}
+
+static void put_u64(uint8_t *p, uint64_t n)
+{
+	put_u32(p, (uint32_t)n);
+	put_u32(p + 4, (uint32_t)(n >> 32));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static uint8_t * put_varint(uint8_t *p, uint64_t n)
+{
+	while (n >= 0x80) {
+		*p++ = (uint8_t)n | 0x80;
+		n >>= 7;
+	}
+	*p++ = (uint8_t)n;
+	return p;
+}
+
+static uint8_t * put_zigzag(uint8_t *p, int64_t n)
+{
+	return put_varint(p, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+}
+
+static uint8_t * put_float(uint8_t *p, float f)
+{
+	union {
+		float f;
+		uint32_t n;
+	} data;
+
+	data.f = f;
+	put_u32(p, data.n);
+	return p + 4;
+}
+
+static uint8_t * put_calibration(uint8_t *p)
+{
+	int i, j;
+
+	for (i=0; i < 3; i++) {
+		p = put_float(p, magcal.V[i]);
+	}
+	for (i=0; i < 3; i++) {
+		for (j=0; j < 3; j++) {
+			p = put_float(p, magcal.invW[i][j]);
+		}
+	}
+	p = put_float(p, magcal.B);
+	p = put_float(p, magcal.FitError);
+	*p++ = magcal.ValidMagCal;
+	return p;
+}
+
+static int write_bytes(const void *ptr, size_t len)
+{
+	if (fwrite(ptr, 1, len, rec_fp) != len) return 0;
+	rec_offset += len;
+	return 1;
+}
+
+// stdout is flushed, never closed: it isn't ours
+static void close_output(void)
+{
+	if (rec_fp == stdout) {
+		fflush(rec_fp);
+	} else if (rec_fp) {
+		fclose(rec_fp);
+	}
+	rec_fp = NULL;
+}
+
+static void start_block(void)
+{
+	uint8_t *p, *count;
+	int16_t last[3];
+	int i, slot, n=0;
+
+	memset(block, 0, REC_BLOCK_HEADER);
+	memcpy(block, "MCBK", 4);
+	block_records = 0;
+	block_samples = 0;
+	block_first_sample = rec_samples;
+	block_first_ns = 0;
+	memset(prev, 0, sizeof(prev));
+	p = block + REC_BLOCK_HEADER;
+	*p++ = REC_SNAPSHOT;
+	p = put_calibration(p);
+	count = p;
+	p += 2;
+	memset(last, 0, sizeof(last));
+	slot = -1;
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (!magcal.valid[i]) continue;
+		p = put_varint(p, i - slot - 1);
+		p = put_zigzag(p, magcal.BpFast[0][i] - last[0]);
+		p = put_zigzag(p, magcal.BpFast[1][i] - last[1]);
+		p = put_zigzag(p, magcal.BpFast[2][i] - last[2]);
+		last[0] = magcal.BpFast[0][i];
+		last[1] = magcal.BpFast[1][i];
+		last[2] = magcal.BpFast[2][i];
+		slot = i;
+		n++;
+	}
+	count[0] = n;
+	count[1] = n >> 8;
+	block_records++;
+	used = p - block;
+}
+
+static void flush_block(void)
+{
+	uint8_t *e, *p;
+
+	if (used == 0) return;
+	put_u32(block + 4, used);
+	put_u32(block + 8, block_records);
+	put_u32(block + 12, block_first_sample);
+	put_u32(block + 28, block_samples);
+	put_u64(block + 32, block_first_ns);
+	memset(block + used, 0, REC_BLOCK_SIZE - used);
+	if (!write_bytes(block, REC_BLOCK_SIZE)) {
+		fprintf(stderr, "recording: write failed, recording stopped\n");
+		close_output();
+	}
+	if (index_lost) {
+		used = 0;
+		return;
+	}
+	if (nblocks >= index_alloc) {
+		p = (uint8_t *)realloc(rec_index, (index_alloc ? index_alloc * 2 : 256) * REC_INDEX_ENTRY);
+		if (p == NULL) {
+			// readers find the blocks by scanning instead
+			free(rec_index);
+			rec_index = NULL;
+			index_alloc = nblocks = 0;
+			index_lost = 1;
+			used = 0;
+			return;
+		}
+		rec_index = p;
+		index_alloc = index_alloc ? index_alloc * 2 : 256;
+	}
+	e = rec_index + nblocks * REC_INDEX_ENTRY;
+	put_u64(e, block_first_ns);
+	put_u32(e + 8, block_first_sample);
+	put_u32(e + 12, block_samples);
+	nblocks++;
+	used = 0;
+}
+
+// make room for a record of up to len bytes
+static uint8_t * record_space(int len)
+{
+	if (used + len > REC_BLOCK_SIZE) flush_block();
+	if (used == 0) {
+		start_block();
+		// the block's deltas start from the previous sample
+		put_u64(block + 16, prev_ns);
+		put_u32(block + 24, prev_us);
+	}
+	return block + used;
+}
+
+// Start recording to path, "-" for stdout, or NULL for the
+// MOTIONCAL_RECORD environment variable.  Returns 0 if there is no path
+// or the file can't be created.
+int recording_start(const char *path)
+{
+	uint8_t header[REC_HEADER_SIZE];
+
+	if (path == NULL) path = getenv("MOTIONCAL_RECORD");
+	if (path == NULL || *path == 0) return 0;
+	recording_stop();
+	rec_fp = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+	if (rec_fp == NULL) return 0;
+	used = 0;
+	rec_samples = 0;
+	nblocks = 0;
+	rec_offset = 0;
+	prev_ns = 0;
+	prev_us = 0;
+	memset(header, 0, sizeof(header));
+	memcpy(header, REC_MAGIC, 8);
+	put_u32(header + 8, REC_BLOCK_SIZE);
+	put_float(header + 12, raw_data_rate());
+	put_u32(header + 16, raw_data_oversample());
+	if (!write_bytes(header, sizeof(header))) {
+		recording_stop();
+		return 0;
+	}
+	return 1;
+}
+
+int recording_active(void)
+{
+	return rec_fp != NULL;
+}
+
+void recording_sample(const int16_t *data, const SampleTime_t *time)
+{
+	uint8_t *p, *tag;
+	int i;
+
+	if (rec_fp == NULL) return;
+	p = tag = record_space(REC_MAX_SAMPLE);
+	*p++ = REC_SAMPLE;
+	if (time == NULL) {
+		*tag |= REC_NO_TIME;
+	} else {
+		p = put_zigzag(p, (int64_t)(time->host_ns - prev_ns));
+		prev_ns = time->host_ns;
+		if (block_samples == 0) block_first_ns = time->host_ns;
+		if (time->has_sensor_us) {
+			*tag |= REC_SENSOR_US;
+			p = put_zigzag(p, (int32_t)(time->sensor_us - prev_us));
+			prev_us = time->sensor_us;
+		}
+	}
+	for (i=0; i < 9; i++) {
+		p = put_zigzag(p, data[i] - prev[i]);
+		prev[i] = data[i];
+	}
+	used = p - block;
+	block_records++;
+	block_samples++;
+	rec_samples++;
+}
+
+// REC_ACCEPT or REC_SENDCAL record the current calibration, REC_CONFIRM
+// which of the two echoes (1 or 2) matched
+void recording_event(int type, int which)
+{
+	uint8_t *p;
+
+	if (rec_fp == NULL) return;
+	p = record_space(64);
+	*p++ = type;
+	if (type == REC_CONFIRM) {
+		*p++ = which;
+	} else {
+		p = put_calibration(p);
+	}
+	used = p - block;
+	block_records++;
+}
+
+void recording_stop(void)
+{
+	uint8_t trailer[REC_TRAILER_SIZE];
+	uint64_t offset;
+
+	if (rec_fp == NULL) return;
+	flush_block();
+	if (rec_fp && rec_index) {
+		offset = rec_offset;
+		put_u64(trailer, offset);
+		put_u32(trailer + 8, nblocks);
+		memcpy(trailer + 12, "MCIX", 4);
+		if (write_bytes(rec_index, nblocks * REC_INDEX_ENTRY)) {
+			write_bytes(trailer, sizeof(trailer));
+		}
+	}
+	close_output();
+	free(rec_index);
+	rec_index = NULL;
+	index_alloc = nblocks = 0;
+	index_lost = 0;
+}
+
+
+// Reading.  The file is mapped rather than read, so opening a long
+// recording costs nothing until its blocks are decoded.
+
+static uint64_t get_varint(const uint8_t **pp, const uint8_t *end)
+{
+	const uint8_t *p = *pp;
+	uint64_t n=0;
+	int shift=0;
+
+	while (p < end && shift < 64) {
+		n |= (uint64_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) break;
+		shift += 7;
+	}
+	*pp = p;
+	return n;
+}
+
+static int64_t get_zigzag(const uint8_t **pp, const uint8_t *end)
+{
+	uint64_t n = get_varint(pp, end);
+
+	return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+static float get_float(const uint8_t **pp, const uint8_t *end)
+{
+	union {
+		float f;
+		uint32_t n;
+	} data;
+
+	data.n = 0;
+	if (*pp + 4 <= end) data.n = get_u32(*pp);
+	*pp += 4;
+	return data.f;
+}
+
+static void get_calibration(const uint8_t **pp, const uint8_t *end, MagCalSnapshot_t *cal)
+{
+	int i, j;
+
+	for (i=0; i < 3; i++) {
+		cal->V[i] = get_float(pp, end);
+	}
+	for (i=0; i < 3; i++) {
+		for (j=0; j < 3; j++) {
+			cal->invW[i][j] = get_float(pp, end);
+		}
+	}
+	cal->B = get_float(pp, end);
+	cal->FitError = get_float(pp, end);
+	cal->ValidMagCal = (*pp < end) ? (int8_t)**pp : 0;
+	(*pp)++;
+}
+
+static const uint8_t * block_at(const RecReader_t *r, uint32_t n)
+{
+	return r->base + REC_HEADER_SIZE + (size_t)n * r->block_size;
+}
+
+// samples before block n, and the host time of its first sample
+static uint32_t block_first(const RecReader_t *r, uint32_t n, uint64_t *host_ns)
+{
+	const uint8_t *p;
+
+	if (r->index) {
+		p = r->index + (size_t)n * REC_INDEX_ENTRY;
+		*host_ns = get_u64(p);
+		return get_u32(p + 8);
+	}
+	p = block_at(r, n);
+	*host_ns = get_u64(p + 32);
+	return get_u32(p + 12);
+}
+
+static void load_block(RecReader_t *r, uint32_t n)
+{
+	const uint8_t *p;
+	uint32_t len;
+
+	r->block = n;
+	r->p = r->end = NULL;
+	r->records = 0;
+	if (n >= r->nblocks) return;
+	p = block_at(r, n);
+	if (memcmp(p, "MCBK", 4) != 0) return;
+	len = get_u32(p + 4);
+	if (len < REC_BLOCK_HEADER || len > r->block_size) return;
+	r->records = get_u32(p + 8);
+	r->sample = get_u32(p + 12);
+	r->host_ns = get_u64(p + 16);
+	r->sensor_us = get_u32(p + 24);
+	memset(r->prev, 0, sizeof(r->prev));
+	r->p = p + REC_BLOCK_HEADER;
+	r->end = p + len;
+}
+
+static void unmap(RecReader_t *r)
+{
+#if defined(LINUX) || defined(MACOSX)
+	if (r->base) munmap((void *)r->base, r->size);
+#else
+	free((void *)r->base);
+#endif
+	r->base = NULL;
+}
+
+// Returns 0 if path isn't a recording.
+int recording_open(RecReader_t *r, const char *path)
+{
+	const uint8_t *t;
+	uint64_t offset;
+	uint32_t n;
+	int fd;
+	struct stat st;
+
+	memset(r, 0, sizeof(*r));
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) != 0 || st.st_size < REC_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+	r->size = st.st_size;
+#if defined(LINUX) || defined(MACOSX)
+	r->base = (const uint8_t *)mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (r->base == MAP_FAILED) r->base = NULL;
+#else
+	r->base = (const uint8_t *)malloc(r->size);
+	if (r->base && read(fd, (void *)r->base, r->size) != (int)r->size) {
+		free((void *)r->base);
+		r->base = NULL;
+	}
+#endif
+	close(fd);
+	if (r->base == NULL) return 0;
+	if (memcmp(r->base, REC_MAGIC, 8) != 0) {
+		unmap(r);
+		return 0;
+	}
+	r->block_size = get_u32(r->base + 8);
+	t = r->base + 12;
+	r->rate = get_float(&t, r->base + 16);
+	r->oversample = get_u32(r->base + 16);
+	if (r->block_size < REC_BLOCK_HEADER) {
+		unmap(r);
+		return 0;
+	}
+	t = r->base + r->size - REC_TRAILER_SIZE;
+	if (r->size >= REC_HEADER_SIZE + REC_TRAILER_SIZE && memcmp(t + 12, "MCIX", 4) == 0) {
+		offset = get_u64(t);
+		n = get_u32(t + 8);
+		if (offset + (uint64_t)n * REC_INDEX_ENTRY + REC_TRAILER_SIZE == r->size
+		  && REC_HEADER_SIZE + (uint64_t)n * r->block_size <= offset) {
+			r->index = r->base + offset;
+			r->nblocks = n;
+		}
+	}
+	if (r->index == NULL) {
+		// cut short: every whole block is still readable
+		r->nblocks = (r->size - REC_HEADER_SIZE) / r->block_size;
+	}
+	load_block(r, 0);
+	return 1;
+}
+
+void recording_close(RecReader_t *r)
+{
+	unmap(r);
+	memset(r, 0, sizeof(*r));
+}
+
+// seconds from the first sample to the start of block n
+static double block_secs(const RecReader_t *r, uint32_t n)
+{
+	uint64_t ns, first_ns;
+	uint32_t sample;
+
+	sample = block_first(r, n, &ns);
+	block_first(r, 0, &first_ns);
+	if (first_ns && ns) return (double)(ns - first_ns) * 1e-9;
+	return r->rate > 0.0f ? sample / r->rate : 0.0;
+}
+
+// Position the reader at the start of the block holding the time secs
+// after the first sample, and return the number of samples before it.
+// The first record there is the block's snapshot.
+uint32_t recording_seek(RecReader_t *r, double secs)
+{
+	uint32_t lo=0, hi, mid;
+
+	hi = r->nblocks;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (block_secs(r, mid) <= secs) lo = mid;
+		else hi = mid;
+	}
+	load_block(r, lo);
+	return r->sample;
+}
+
+// Decode the next record.  Returns 0 at the end of the recording.
+int recording_next(RecReader_t *r, RecRecord_t *rec)
+{
+	const uint8_t *p, *end;
+	int16_t last[3];
+	uint32_t n, i;
+	int tag, slot;
+
+	while (r->records == 0) {
+		if (r->p == NULL || r->block + 1 >= r->nblocks) return 0;
+		load_block(r, r->block + 1);
+	}
+	r->records--;
+	p = r->p;
+	end = r->end;
+	tag = *p++;
+	rec->type = tag & 7;
+	rec->sample = r->sample;
+	switch (rec->type) {
+	case REC_SAMPLE:
+		rec->has_time = !(tag & REC_NO_TIME);
+		memset(&rec->time, 0, sizeof(rec->time));
+		if (rec->has_time) {
+			r->host_ns += get_zigzag(&p, end);
+			rec->time.host_ns = r->host_ns;
+			if (tag & REC_SENSOR_US) {
+				r->sensor_us += (int32_t)get_zigzag(&p, end);
+				rec->time.sensor_us = r->sensor_us;
+				rec->time.has_sensor_us = 1;
+			}
+		}
+		for (i=0; i < 9; i++) {
+			r->prev[i] += get_zigzag(&p, end);
+			rec->data[i] = r->prev[i];
+		}
+		r->sample++;
+		break;
+	case REC_ACCEPT:
+	case REC_SENDCAL:
+		get_calibration(&p, end, &rec->cal);
+		break;
+	case REC_CONFIRM:
+		rec->which = (p < end) ? *p : 0;
+		p++;
+		break;
+	case REC_SNAPSHOT:
+		get_calibration(&p, end, &rec->cal);
+		memset(rec->cal.valid, 0, sizeof(rec->cal.valid));
+		n = (p + 2 <= end) ? p[0] | (p[1] << 8) : 0;
+		p += 2;
+		memset(last, 0, sizeof(last));
+		slot = -1;
+		for (i=0; i < n && p < end; i++) {
+			slot += (int)get_varint(&p, end) + 1;
+			last[0] += get_zigzag(&p, end);
+			last[1] += get_zigzag(&p, end);
+			last[2] += get_zigzag(&p, end);
+			if (slot >= MAGBUFFSIZE) break;
+			rec->cal.BpFast[0][slot] = last[0];
+			rec->cal.BpFast[1][slot] = last[1];
+			rec->cal.BpFast[2][slot] = last[2];
+			rec->cal.valid[slot] = 1;
+		}
+		break;
+	default:
+		// unknown record: the rest of the block can't be decoded
+		r->records = 0;
+		return recording_next(r, rec);
+	}
+	if (p > end) {
+		r->records = 0;
+		return 0;
+	}
+	r->p = p;
+	return 1;
+}
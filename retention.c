@@ -0,0 +1,251 @@
+#include "imuread.h"
+
+// Once the calibration buffer is full, every new reading means choosing
+// which old reading to discard.  We must choose wisely!  Throwing away the
+// wrong data could prevent collecting enough data distributed across the
+// entire 3D angular range, preventing a decent cal from ever happening at
+// all.  Each policy here makes that choice differently: it returns the
+// slot to overwrite, or -1 to keep the buffer as it is and drop the new
+// reading.
+
+typedef struct {
+	const char *name;
+	void (*reset)(void);
+	int (*choose)(const int16_t *data);
+} RetentionPolicy_t;
+
+static uint32_t slot_seq[MAGBUFFSIZE];  // when each slot was last written
+static uint32_t seq;
+
+
+// classic: purge the worst field magnitude once coverage is good,
+// otherwise drop one of the two closest readings
+
+static int classic_runcount;
+
+static void classic_reset(void)
+{
+	classic_runcount = 0;
+}
+
+static int classic_choose(const int16_t *data)
+{
+	int32_t rawx, rawy, rawz;
+	int32_t dx, dy, dz;
+	float x, y, z;
+	uint64_t distsq, minsum=0xFFFFFFFFFFFFFFFFull;
+	int i, j, minindex=0;
+	Point_t point;
+	float gaps, field, error, errormax;
+
+	// Making any assumption about good vs bad data is particularly risky,
+	// because being wrong could cause an unstable feedback loop where
+	// bad data leads to wrong decisions which leads to even worse data.
+	// But if done well, purging bad data has massive potential to
+	// improve results.  The trick is telling the good from the bad while
+	// still in the process of learning what's good...
+	//
+	// When enough data is collected (gaps error is low), assume we
+	// have a pretty good coverage and the field stregth is known.
+	gaps = quality_surface_gap_error();
+	if (gaps < 25.0f) {
+		// occasionally look for points farthest from average field strength
+		// always rate limit assumption-based data purging, but allow the
+		// rate to increase as the angular coverage improves.
+		if (gaps < 1.0f) gaps = 1.0f;
+		if (++classic_runcount > (int)(gaps * 10.0f)) {
+			j = MAGBUFFSIZE;
+			errormax = 0.0f;
+			for (i=0; i < MAGBUFFSIZE; i++) {
+				rawx = magcal.BpFast[0][i];
+				rawy = magcal.BpFast[1][i];
+				rawz = magcal.BpFast[2][i];
+				apply_calibration(rawx, rawy, rawz, &point);
+				x = point.x;
+				y = point.y;
+				z = point.z;
+				field = sqrtf(x * x + y * y + z * z);
+				// if magcal.B is bad, things could go horribly wrong
+				error = fabsf(field - magcal.B);
+				if (error > errormax) {
+					errormax = error;
+					j = i;
+				}
+			}
+			classic_runcount = 0;
+			if (j < MAGBUFFSIZE) {
+				//printf("worst error at %d\n", j);
+				return j;
+			}
+		}
+	} else {
+		classic_runcount = 0;
+	}
+	// When solid info isn't availabe, find 2 points closest to each other,
+	// and randomly discard one.  When we don't have good coverage, this
+	// approach tends to add points into previously unmeasured areas while
+	// discarding info from areas with highly redundant info.
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		for (j=i+1; j < MAGBUFFSIZE; j++) {
+			dx = magcal.BpFast[0][i] - magcal.BpFast[0][j];
+			dy = magcal.BpFast[1][i] - magcal.BpFast[1][j];
+			dz = magcal.BpFast[2][i] - magcal.BpFast[2][j];
+			distsq = (int64_t)dx * (int64_t)dx;
+			distsq += (int64_t)dy * (int64_t)dy;
+			distsq += (int64_t)dz * (int64_t)dz;
+			if (distsq < minsum) {
+				minsum = distsq;
+				minindex = (prng_next(&magcal.rng) & 1) ? i : j;
+			}
+		}
+	}
+	return minindex;
+}
+
+
+// coverage: keep the readings spread evenly over quality.c's 100 equal
+// area sphere regions.  The new reading displaces one from the fullest
+// region, so a region can only grow past its share of the buffer while
+// others are still empty.  Linear in the buffer size.
+
+static int8_t slot_region[MAGBUFFSIZE];  // -1 = not yet computed
+static float region_V[3];                // calibration slot_region was computed with
+static float region_invW[3][3];
+
+static void coverage_reset(void)
+{
+	memset(slot_region, 0xFF, sizeof(slot_region));
+	memset(region_V, 0, sizeof(region_V));
+	memset(region_invW, 0, sizeof(region_invW));
+}
+
+static int reading_region(int16_t x, int16_t y, int16_t z)
+{
+	Point_t point;
+
+	apply_calibration(x, y, z, &point);
+	return quality_sphere_region(&point);
+}
+
+static int coverage_choose(const int16_t *data)
+{
+	int count[100];
+	int i, region, fullest, slot;
+	uint32_t age, agemax;
+	float field, error, errormax;
+	Point_t point;
+
+	// regions move whenever the calibration does
+	if (memcmp(region_V, magcal.V, sizeof(region_V)) != 0
+	  || memcmp(region_invW, magcal.invW, sizeof(region_invW)) != 0) {
+		memset(slot_region, 0xFF, sizeof(slot_region));
+		memcpy(region_V, magcal.V, sizeof(region_V));
+		memcpy(region_invW, magcal.invW, sizeof(region_invW));
+	}
+	memset(count, 0, sizeof(count));
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (slot_region[i] < 0) {
+			slot_region[i] = reading_region(magcal.BpFast[0][i],
+				magcal.BpFast[1][i], magcal.BpFast[2][i]);
+		}
+		count[(int)slot_region[i]]++;
+	}
+	region = reading_region(data[6], data[7], data[8]);
+	fullest = region;
+	for (i=0; i < 100; i++) {
+		if (count[i] > count[fullest]) fullest = i;
+	}
+	// within the fullest region, the worst field magnitude once the
+	// calibration can be trusted, otherwise the oldest reading
+	slot = -1;
+	agemax = 0;
+	errormax = -1.0f;
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (slot_region[i] != fullest) continue;
+		if (magcal.ValidMagCal && fullest != region) {
+			apply_calibration(magcal.BpFast[0][i], magcal.BpFast[1][i],
+				magcal.BpFast[2][i], &point);
+			field = sqrtf(point.x * point.x + point.y * point.y + point.z * point.z);
+			error = fabsf(field - magcal.B);
+			if (error > errormax) {
+				errormax = error;
+				slot = i;
+			}
+		} else {
+			age = seq - slot_seq[i];
+			if (slot < 0 || age > agemax) {
+				agemax = age;
+				slot = i;
+			}
+		}
+	}
+	return slot;
+}
+
+
+// reservoir: every reading since the reset has the same chance of being
+// in the buffer.  Cheap and unbiased, but it never forgets, so it suits a
+// sensor fixed in place better than hard iron that changes.
+
+static uint32_t reservoir_seen;
+
+static void reservoir_reset(void)
+{
+	reservoir_seen = MAGBUFFSIZE;
+}
+
+static int reservoir_choose(const int16_t *data)
+{
+	uint32_t n;
+
+	n = prng_below(&magcal.rng, ++reservoir_seen);
+	if (n < MAGBUFFSIZE) return n;
+	return -1;
+}
+
+
+static const RetentionPolicy_t policies[] = {
+	{"classic", classic_reset, classic_choose},
+	{"coverage", coverage_reset, coverage_choose},
+	{"reservoir", reservoir_reset, reservoir_choose},
+};
+#define NUM_POLICIES (int)(sizeof(policies) / sizeof(RetentionPolicy_t))
+
+static const RetentionPolicy_t *policy = &policies[0];
+
+int retention_set_policy(const char *name)
+{
+	int i;
+
+	for (i=0; i < NUM_POLICIES; i++) {
+		if (strcmp(name, policies[i].name) == 0) {
+			policy = &policies[i];
+			retention_reset();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+const char * retention_policy_name(void)
+{
+	return policy->name;
+}
+
+void retention_reset(void)
+{
+	memset(slot_seq, 0, sizeof(slot_seq));
+	seq = 0;
+	policy->reset();
+}
+
+int retention_choose(const int16_t *data)
+{
+	return policy->choose(data);
+}
+
+void retention_added(int slot)
+{
+	slot_seq[slot] = ++seq;
+	slot_region[slot] = -1;
+}
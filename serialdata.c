@@ -1,5 +1,6 @@
 #include "imuread.h"
 
+static uint64_t rx_ns;  // host time the bytes being parsed were read
 
 void print_data(const char *name, const unsigned char *data, int len)
 {
@@ -12,7 +13,7 @@ void print_data(const char *name, const unsigned char *data, int len)
 	printf("\n");
 }
 
-static int packet_primary_data(const unsigned char *data)
+static int packet_primary_data(const unsigned char *data, int len)
 {
 	//current_position.x = (float)((int16_t)((data[13] << 8) | data[12])) / 10.0f;
 	//current_position.y = (float)((int16_t)((data[15] << 8) | data[14])) / 10.0f;
@@ -21,6 +22,15 @@ static int packet_primary_data(const unsigned char *data)
 	current_orientation.q1 = (float)((int16_t)((data[27] << 8) | data[26])) / 30000.0f;
 	current_orientation.q2 = (float)((int16_t)((data[29] << 8) | data[28])) / 30000.0f;
 	current_orientation.q3 = (float)((int16_t)((data[31] << 8) | data[30])) / 30000.0f;
+	current_orientation_time.host_ns = rx_ns;
+	current_orientation_time.sensor_us = 0;
+	current_orientation_time.has_sensor_us = 0;
+	if (len >= 38) {
+		// newer firmware appends its microsecond clock
+		current_orientation_time.sensor_us = data[34] | (data[35] << 8)
+			| (data[36] << 16) | ((uint32_t)data[37] << 24);
+		current_orientation_time.has_sensor_us = 1;
+	}
 #if 0
 	printf("mag data, %5.2f %5.2f %5.2f\n",
 		current_position.x,
@@ -87,8 +97,8 @@ static int packet(const unsigned char *data, int len)
 	if (len <= 0) return 0;
 	//print_data("packet", data, len);
 
-	if (data[0] == 1 && len == 34) {
-		return packet_primary_data(data);
+	if (data[0] == 1 && (len == 34 || len == 38)) {
+		return packet_primary_data(data, len);
 	} else if (data[0] == 6 && len == 14) {
 		return packet_magnetic_cal(data);
 	}
@@ -135,10 +145,11 @@ static int packet_encoded(const unsigned char *data, int len)
 	}
 }
 
+static unsigned char packetbuf[256];
+static unsigned int packetlen=0;
+
 static int packet_parse(const unsigned char *data, int len)
 {
-	static unsigned char packetbuf[256];
-	static unsigned int packetlen=0;
 	const unsigned char *p;
 	int copylen;
 	int ret=0;
@@ -182,13 +193,16 @@ static int packet_parse(const unsigned char *data, int len)
 #define ASCII_STATE_CAL1  2
 #define ASCII_STATE_CAL2  3
 
+static int ascii_state=ASCII_STATE_WORD;
+static int ascii_num=0, ascii_neg=0, ascii_count=0;
+static int16_t ascii_raw_data[9];
+static uint32_t ascii_time=0;
+static float ascii_cal_data[10];
+static unsigned int ascii_raw_data_count=0;
+
 static int ascii_parse(const unsigned char *data, int len)
 {
-	static int ascii_state=ASCII_STATE_WORD;
-	static int ascii_num=0, ascii_neg=0, ascii_count=0;
-	static int16_t ascii_raw_data[9];
-	static float ascii_cal_data[10];
-	static unsigned int ascii_raw_data_count=0;
+	SampleTime_t time;
 	const char *p, *end;
 	int ret=0;
 
@@ -260,26 +274,42 @@ static int ascii_parse(const unsigned char *data, int len)
 				ascii_neg = 1;
 			} else if (isdigit(*p)) {
 				//printf("ascii_parse digit\n");
-				ascii_num = ascii_num * 10 + *p - '0';
+				if (ascii_raw_data_count == 9) {
+					// optional 10th field, the sensor's microsecond clock
+					ascii_time = ascii_time * 10 + *p - '0';
+				} else {
+					ascii_num = ascii_num * 10 + *p - '0';
+				}
 				ascii_count++;
 			} else if (*p == ',') {
 				//printf("ascii_parse comma, %d\n", ascii_num);
 				if (ascii_neg) ascii_num = -ascii_num;
 				if (ascii_num < -32768 && ascii_num > 32767) goto fail;
-				if (ascii_raw_data_count >= 8) goto fail;
+				if (ascii_raw_data_count >= 9) goto fail;
 				ascii_raw_data[ascii_raw_data_count++] = ascii_num;
 				ascii_num = 0;
 				ascii_neg = 0;
 				ascii_count = 0;
+				ascii_time = 0;
 			} else if (*p == 13) {
 				//printf("ascii_parse newline\n");
-				if (ascii_neg) ascii_num = -ascii_num;
-				if (ascii_num < -32768 && ascii_num > 32767) goto fail;
-				if (ascii_raw_data_count != 8) goto fail;
-				ascii_raw_data[ascii_raw_data_count] = ascii_num;
-				raw_data(ascii_raw_data);
+				time.host_ns = rx_ns;
+				time.sensor_us = 0;
+				time.has_sensor_us = 0;
+				if (ascii_raw_data_count == 9) {
+					if (ascii_neg || ascii_count == 0) goto fail;
+					time.sensor_us = ascii_time;
+					time.has_sensor_us = 1;
+				} else {
+					if (ascii_neg) ascii_num = -ascii_num;
+					if (ascii_num < -32768 && ascii_num > 32767) goto fail;
+					if (ascii_raw_data_count != 8) goto fail;
+					ascii_raw_data[ascii_raw_data_count] = ascii_num;
+				}
+				raw_data_timed(ascii_raw_data, &time);
 				ret = 1;
 				ascii_raw_data_count = 0;
+				ascii_time = 0;
 				ascii_num = 0;
 				ascii_neg = 0;
 				ascii_count = 0;
@@ -346,14 +376,40 @@ fail:
 	ascii_num = 0;
 	ascii_neg = 0;
 	ascii_count = 0;
+	ascii_time = 0;
 	return 0;
 }
 
+// Drop any partial packet or line, so the next bytes parse as the start
+// of a new stream rather than the rest of the last one's
+void newdata_reset(void)
+{
+	packetlen = 0;
+	ascii_state = ASCII_STATE_WORD;
+	ascii_raw_data_count = 0;
+	ascii_num = 0;
+	ascii_neg = 0;
+	ascii_count = 0;
+	ascii_time = 0;
+}
 
-static void newdata(const unsigned char *data, int len)
+void newdata(const unsigned char *data, int len)
 {
+	newdata_timed(data, len, monotonic_ns());
+}
+
+// host_ns is when these bytes were read from the port, which the parsers
+// attach to every sample they complete
+void newdata_timed(const unsigned char *data, int len, uint64_t host_ns)
+{
+	STAT_BEGIN(STAT_PARSE);
+	TRACE_BEGIN();
+	STAT_ADD(STAT_BYTES, len);
+	rx_ns = host_ns;
 	packet_parse(data, len);
 	ascii_parse(data, len);
+	TRACE_END("parse", len);
+	STAT_END(STAT_PARSE);
 	// TODO: learn which one and skip the other
 }
 
@@ -361,8 +417,29 @@ static void newdata(const unsigned char *data, int len)
 
 #if defined(LINUX) || defined(MACOSX)
 
+#if defined(MACOSX)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
 static int portfd=-1;
 
+uint64_t monotonic_ns(void)
+{
+#if defined(MACOSX)
+	static mach_timebase_info_data_t timebase;
+
+	if (timebase.denom == 0) mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
 int port_is_open(void)
 {
 	if (portfd > 0) return 1;
@@ -391,20 +468,31 @@ int open_port(const char *name)
 	return 1;
 }
 
+// drain up to this much per call, as the Windows version does, so fast
+// sensors are not limited to 256 bytes per GUI timer tick
+#define READ_DRAIN_MAX 16384
+
 int read_serial_data(void)
 {
 	unsigned char buf[256];
 	static int nodata_count=0;
-	int n;
+	uint64_t now;
+	int n, total=0;
 
 	if (portfd < 0) return -1;
-	while (1) {
+	now = monotonic_ns();  // one timestamp for everything this drain finds
+	while (total < READ_DRAIN_MAX) {
+		STAT_BEGIN(STAT_READ);
+		TRACE_BEGIN();
 		n = read(portfd, buf, sizeof(buf));
+		TRACE_END("read", n);
+		STAT_END(STAT_READ);
 		if (n > 0 && n <= sizeof(buf)) {
-			newdata(buf, n);
+			newdata_timed(buf, n, now);
 			nodata_count = 0;
-			return n;
+			total += n;
 		} else if (n == 0) {
+			if (total > 0) break;
 			if (++nodata_count > 6) {
 				close_port();
 				nodata_count = 0;
@@ -415,7 +503,7 @@ int read_serial_data(void)
 		} else {
 			n = errno;
 			if (n == EAGAIN) {
-				return 0;
+				break;
 			} else if (n == EINTR) {
 			} else {
 				close_port();
@@ -423,6 +511,27 @@ int read_serial_data(void)
 			}
 		}
 	}
+	return total;
+}
+
+// Block until the port has data to read, or msec pass, for callers
+// without a GUI timer.  Returns 1 if there is data (or the device is
+// gone, which read_serial_data() reports), 0 on timeout, -1 if the port
+// isn't open.
+int wait_serial_data(int msec)
+{
+	fd_set rfds;
+	struct timeval tv;
+	int n;
+
+	if (portfd < 0) return -1;
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	FD_ZERO(&rfds);
+	FD_SET(portfd, &rfds);
+	n = select(portfd+1, &rfds, NULL, NULL, &tv);
+	if (n < 0 && errno != EINTR) return -1;
+	return n > 0;
 }
 
 int write_serial_data(const void *ptr, int len)
@@ -461,10 +570,74 @@ void close_port(void)
 	}
 }
 
+#if defined(LINUX)
+static int read_sysfs(const char *dir, const char *file, char *buf, int len)
+{
+	char path[4200];
+	FILE *fp;
+	int n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fp = fopen(path, "r");
+	if (fp == NULL) return 0;
+	if (fgets(buf, len, fp) == NULL) buf[0] = 0;
+	fclose(fp);
+	n = strlen(buf);
+	while (n > 0 && isspace((unsigned char)buf[n-1])) buf[--n] = 0;
+	return n > 0;
+}
+#endif
+
+// Identify the device behind a port: the USB vendor, product and serial
+// number where the system tells us, otherwise just the port name.
+// Returns 1 for a real device identity.
+int port_device_id(const char *name, char *id, int len)
+{
+#if defined(LINUX)
+	char path[4096], dev[4200], vid[16], pid[16], serial[128];
+	char *p;
+
+	// the tty's device is a USB interface, the serial number is on its parent
+	if (realpath(name, path) != NULL && (p = strrchr(path, '/')) != NULL) {
+		snprintf(dev, sizeof(dev), "/sys/class/tty/%s/device", p + 1);
+		if (realpath(dev, path) != NULL) {
+			while ((p = strrchr(path, '/')) != NULL && p > path) {
+				if (read_sysfs(path, "idVendor", vid, sizeof(vid))) {
+					// the first USB device up is the adapter.  Without a
+					// serial number (CH340, many FTDI clones) it can't
+					// be told from others like it; don't climb on to a hub
+					if (read_sysfs(path, "serial", serial, sizeof(serial))
+					  && read_sysfs(path, "idProduct", pid, sizeof(pid))) {
+						snprintf(id, len, "%s:%s:%s", vid, pid, serial);
+						return 1;
+					}
+					break;
+				}
+				*p = 0;
+			}
+		}
+	}
+#endif
+	// macOS names USB modems by location, not serial number
+	snprintf(id, len, "%s", name);
+	return 0;
+}
+
 #elif defined(WINDOWS)
 
 static HANDLE port_handle=INVALID_HANDLE_VALUE;
 
+uint64_t monotonic_ns(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ull
+		+ (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+}
+
 int port_is_open(void)
 {
 	if (port_handle == INVALID_HANDLE_VALUE) return 0;
@@ -545,9 +718,11 @@ int read_serial_data(void)
 	DWORD errmask=0, num_read, num_request;
 	OVERLAPPED ov;
 	unsigned char buf[256];
+	uint64_t now;
 	int r;
 
 	if (port_handle == INVALID_HANDLE_VALUE) return -1;
+	now = monotonic_ns();
 	while (1) {
 		if (!ClearCommError(port_handle, &errmask, &st)) {
 			r = -1;
@@ -574,6 +749,8 @@ int read_serial_data(void)
 		}
 		ov.Internal = ov.InternalHigh = 0;
 		ov.Offset = ov.OffsetHigh = 0;
+		STAT_BEGIN(STAT_READ);
+		TRACE_BEGIN();
 		if (ReadFile(port_handle, buf, num_request, &num_read, &ov)) {
 			// this should usually be the result, since we asked for
 			// data we knew was already buffered
@@ -593,9 +770,11 @@ int read_serial_data(void)
 				r = -1;
 			}
 		}
+		TRACE_END("read", r);
+		STAT_END(STAT_READ);
 		CloseHandle(ov.hEvent);
 		if (r <= 0) break;
-		newdata(buf, r);
+		newdata_timed(buf, r, now);
 	}
 	if (r < 0) {
 		CloseHandle(port_handle);
@@ -604,6 +783,24 @@ int read_serial_data(void)
         return r;
 }
 
+// no readiness wait here without overlapped WaitCommEvent, so poll the
+// receive queue each millisecond
+int wait_serial_data(int msec)
+{
+	COMSTAT st;
+	DWORD errmask=0;
+	uint64_t end;
+
+	if (port_handle == INVALID_HANDLE_VALUE) return -1;
+	end = monotonic_ns() + (uint64_t)msec * 1000000;
+	while (1) {
+		if (!ClearCommError(port_handle, &errmask, &st)) return 1;
+		if (st.cbInQue > 0) return 1;
+		if (monotonic_ns() >= end) return 0;
+		Sleep(1);
+	}
+}
+
 int write_serial_data(const void *ptr, int len)
 {
 	DWORD num_written;
@@ -641,5 +838,11 @@ void close_port(void)
 	port_handle = INVALID_HANDLE_VALUE;
 }
 
+int port_device_id(const char *name, char *id, int len)
+{
+	snprintf(id, len, "%s", name);
+	return 0;
+}
+
 
 #endif
@@ -0,0 +1,367 @@
+#include "imuread.h"
+#if defined(LINUX) || defined(MACOSX)
+#include <pthread.h>
+#include <sys/mman.h>
+#elif defined(WINDOWS)
+#include <io.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Session persistence.  Reopening a port used to start from an empty
+// buffer, so the operator had to rotate a board that was calibrated
+// minutes ago through every orientation again.  Now the calibration and
+// buffer are saved per device every few seconds while they change, and
+// restored when the device is opened again.  The quality metrics are
+// computed from the buffer, so they come back with it.  The restored
+// calibration only counts once new readings agree with it, since another
+// board may have been plugged into the same port (magcal_verify_restored).
+//
+// Separately, each device's last calibration is kept in a small text
+// file, the calibration cache.  When there is no session to resume, it
+// warm starts the solver (see magcal_warm_start), so recalibrating a
+// board that was calibrated last week takes a fraction of the readings.
+//
+// The session file is the SessionFile_t below, in the host's layout: it is
+// only ever read back by the same build that wrote it, and the header
+// rejects any other.  Saving happens on a background thread, by writing
+// a temporary file and renaming it over the old one, so a crash leaves
+// either the old or the new session and never half of each.
+
+#define SESSION_MAGIC      "MCSESS01"
+#define SESSION_SAVE_SECS  5.0
+
+typedef struct {
+	char magic[8];
+	uint32_t size;               // sizeof(SessionFile_t)
+	uint32_t magbuffsize;
+	uint32_t checksum;           // FNV-1a of snap
+	uint32_t reserved;
+	MagCalSnapshot_t snap;
+} SessionFile_t;
+
+static char session_path[1024];     // "" = no port open
+static char session_id[256];        // the device's identity
+static MagCalSnapshot_t saved;      // what the file holds now
+static uint64_t last_save_ns;
+
+#if defined(LINUX) || defined(MACOSX)
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t save_idle = PTHREAD_COND_INITIALIZER;
+static int save_thread_started=0;
+static int save_busy=0;
+#endif
+static int save_pending=0;
+static SessionFile_t pending;
+static char pending_path[1024];
+
+static uint32_t fnv1a(const void *ptr, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)ptr;
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// The directory is MOTIONCAL_SESSION_DIR, or .motioncal in the home
+// directory (MotionCal in %APPDATA% on Windows).  The device identity
+// becomes the file name, with anything but letters and digits replaced.
+static int make_path(const char *kind, const char *id, char *path, int len)
+{
+	const char *dir;
+	char name[256];
+	int i;
+
+	for (i=0; id[i] && i < (int)sizeof(name) - 1; i++) {
+		name[i] = isalnum((unsigned char)id[i]) ? id[i] : '_';
+	}
+	name[i] = 0;
+	dir = getenv("MOTIONCAL_SESSION_DIR");
+	if (dir && *dir) {
+		snprintf(path, len, "%s/%s-%s", dir, kind, name);
+		return 1;
+	}
+#if defined(WINDOWS)
+	dir = getenv("APPDATA");
+	if (dir == NULL) return 0;
+	snprintf(path, len, "%s\\MotionCal", dir);
+	mkdir(path);
+	snprintf(path, len, "%s\\MotionCal\\%s-%s", dir, kind, name);
+#else
+	dir = getenv("HOME");
+	if (dir == NULL) return 0;
+	snprintf(path, len, "%s/.motioncal", dir);
+	mkdir(path, 0755);
+	snprintf(path, len, "%s/.motioncal/%s-%s", dir, kind, name);
+#endif
+	return 1;
+}
+
+static int write_file(const char *path, const void *data, int len)
+{
+	char tmp[1100];
+	int fd, ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0) return 0;
+	ok = (write(fd, data, len) == len);
+#if defined(LINUX) || defined(MACOSX)
+	if (ok) ok = (fsync(fd) == 0);  // the data is on disk before the rename
+#endif
+	if (close(fd) != 0) ok = 0;
+	if (!ok) {
+		remove(tmp);
+		return 0;
+	}
+#if defined(WINDOWS)
+	remove(path);  // rename won't replace an existing file
+#endif
+	if (rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+#if defined(LINUX) || defined(MACOSX)
+static void * save_thread(void *arg)
+{
+	SessionFile_t *file;
+	char path[1024];
+
+	file = (SessionFile_t *)malloc(sizeof(SessionFile_t));
+	if (file == NULL) return NULL;
+	pthread_mutex_lock(&save_lock);
+	while (1) {
+		while (!save_pending) {
+			pthread_cond_wait(&save_wake, &save_lock);
+		}
+		memcpy(file, &pending, sizeof(SessionFile_t));
+		memcpy(path, pending_path, sizeof(path));
+		save_pending = 0;
+		save_busy = 1;
+		pthread_mutex_unlock(&save_lock);
+		write_file(path, file, sizeof(SessionFile_t));
+		pthread_mutex_lock(&save_lock);
+		save_busy = 0;
+		pthread_cond_broadcast(&save_idle);
+	}
+	return NULL;
+}
+#endif
+
+static void queue_save(void)
+{
+	SessionFile_t *file = &pending;
+
+#if defined(LINUX) || defined(MACOSX)
+	pthread_t thread;
+
+	if (!save_thread_started) {
+		if (pthread_create(&thread, NULL, save_thread, NULL) == 0) {
+			pthread_detach(thread);
+			save_thread_started = 1;
+		}
+	}
+	pthread_mutex_lock(&save_lock);
+#endif
+	memset(file, 0, sizeof(*file));
+	memcpy(file->magic, SESSION_MAGIC, 8);
+	file->size = sizeof(SessionFile_t);
+	file->magbuffsize = MAGBUFFSIZE;
+	memcpy(&file->snap, &saved, sizeof(saved));
+	file->checksum = fnv1a(&file->snap, sizeof(file->snap));
+	snprintf(pending_path, sizeof(pending_path), "%s", session_path);
+	save_pending = 1;
+#if defined(LINUX) || defined(MACOSX)
+	if (save_thread_started) {
+		pthread_cond_signal(&save_wake);
+		pthread_mutex_unlock(&save_lock);
+		return;
+	}
+	pthread_mutex_unlock(&save_lock);
+#endif
+	// no thread to hand it to: save it now
+	write_file(pending_path, file, sizeof(SessionFile_t));
+	save_pending = 0;
+}
+
+// wait for any save in progress or queued to finish
+static void save_wait(void)
+{
+#if defined(LINUX) || defined(MACOSX)
+	pthread_mutex_lock(&save_lock);
+	while (save_pending || save_busy) {
+		pthread_cond_wait(&save_idle, &save_lock);
+	}
+	pthread_mutex_unlock(&save_lock);
+#endif
+}
+
+// a session worth restoring: a calibration that MagCal_Run() would accept
+static int session_is_sane(const MagCalSnapshot_t *snap)
+{
+	int i, j, count=0;
+
+	if (snap->ValidMagCal != 4 && snap->ValidMagCal != 7 && snap->ValidMagCal != 10) return 0;
+	if (!(snap->B >= MINBFITUT && snap->B <= MAXBFITUT)) return 0;
+	if (!(snap->FitError >= 0.0f && snap->FitError < 100.0f)) return 0;
+	for (i=0; i < 3; i++) {
+		if (!(fabsf(snap->V[i]) < 1000.0f)) return 0;
+		for (j=0; j < 3; j++) {
+			if (!(fabsf(snap->invW[i][j]) < 10.0f)) return 0;
+		}
+	}
+	for (i=0; i < MAGBUFFSIZE; i++) {
+		if (snap->valid[i] > 1 || snap->valid[i] < 0) return 0;
+		count += snap->valid[i];
+	}
+	return count > 0;
+}
+
+// Cache the device's calibration: the solver, fit error, V, invW and B as
+// text, so the cache can be read and edited by hand.
+int calcache_save(const char *id)
+{
+	char path[1024], buf[512];
+	int len;
+
+	if (!magcal.ValidMagCal) return 0;
+	if (!make_path("cal", id, path, sizeof(path) - 4)) return 0;
+	strcat(path, ".txt");
+	len = snprintf(buf, sizeof(buf), "MotionCal calibration 1\n"
+		"solver %d\nfit_error %.3f\nV %.4f %.4f %.4f\n"
+		"invW %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\nB %.4f\n",
+		magcal.ValidMagCal, magcal.FitError, magcal.V[0], magcal.V[1], magcal.V[2],
+		magcal.invW[0][0], magcal.invW[0][1], magcal.invW[0][2],
+		magcal.invW[1][0], magcal.invW[1][1], magcal.invW[1][2],
+		magcal.invW[2][0], magcal.invW[2][1], magcal.invW[2][2], magcal.B);
+	return write_file(path, buf, len);
+}
+
+// Warm start from the device's cached calibration.  Call after a reset.
+int calcache_load(const char *id)
+{
+	MagCalSnapshot_t cal;
+	char path[1024];
+	FILE *fp;
+	int n, solver;
+	float *w;
+
+	if (!make_path("cal", id, path, sizeof(path) - 4)) return 0;
+	strcat(path, ".txt");
+	fp = fopen(path, "r");
+	if (fp == NULL) return 0;
+	memset(&cal, 0, sizeof(cal));
+	w = &cal.invW[0][0];
+	n = fscanf(fp, "MotionCal calibration 1 solver %d fit_error %f V %f %f %f "
+		"invW %f %f %f %f %f %f %f %f %f B %f", &solver, &cal.FitError,
+		&cal.V[0], &cal.V[1], &cal.V[2], &w[0], &w[1], &w[2], &w[3], &w[4],
+		&w[5], &w[6], &w[7], &w[8], &cal.B);
+	fclose(fp);
+	if (n != 15) return 0;
+	cal.ValidMagCal = solver;
+	cal.valid[0] = 1;  // session_is_sane() wants a reading
+	if (!session_is_sane(&cal)) return 0;
+	magcal_warm_start(&cal);
+	return 1;
+}
+
+// Restore the device's saved session, from a mapped file, or else warm
+// start from its cached calibration.  Call after open_port() and a reset.
+// Returns SESSION_RESUMED, SESSION_WARM or SESSION_NONE.
+int session_open(const char *port)
+{
+	const SessionFile_t *file;
+	struct stat st;
+	int fd, r=SESSION_NONE;
+
+	session_close();
+	port_device_id(port, session_id, sizeof(session_id));
+	if (!make_path("session", session_id, session_path, sizeof(session_path) - 4)) {
+		session_path[0] = 0;
+		return SESSION_NONE;
+	}
+	strcat(session_path, ".bin");
+	last_save_ns = monotonic_ns();
+	raw_data_snapshot(&saved);
+	fd = open(session_path, O_RDONLY | O_BINARY);
+	if (fd < 0) goto warm;
+	if (fstat(fd, &st) != 0 || st.st_size != sizeof(SessionFile_t)) {
+		close(fd);
+		goto warm;
+	}
+#if defined(LINUX) || defined(MACOSX)
+	file = (const SessionFile_t *)mmap(NULL, sizeof(SessionFile_t), PROT_READ,
+		MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) file = NULL;
+#else
+	file = (const SessionFile_t *)malloc(sizeof(SessionFile_t));
+	if (file && read(fd, (void *)file, sizeof(SessionFile_t)) != sizeof(SessionFile_t)) {
+		free((void *)file);
+		file = NULL;
+	}
+#endif
+	close(fd);
+	if (file == NULL) goto warm;
+	if (memcmp(file->magic, SESSION_MAGIC, 8) == 0
+	  && file->size == sizeof(SessionFile_t)
+	  && file->magbuffsize == MAGBUFFSIZE
+	  && file->checksum == fnv1a(&file->snap, sizeof(file->snap))
+	  && session_is_sane(&file->snap)) {
+		raw_data_restore(&file->snap);
+		magcal_verify_restored();
+		raw_data_snapshot(&saved);
+		r = SESSION_RESUMED;
+	}
+#if defined(LINUX) || defined(MACOSX)
+	munmap((void *)file, sizeof(SessionFile_t));
+#else
+	free((void *)file);
+#endif
+	if (r == SESSION_RESUMED) return r;
+warm:
+	if (calcache_load(session_id)) r = SESSION_WARM;
+	return r;
+}
+
+// Called from the GUI timer.  Every SESSION_SAVE_SECS, a changed session
+// is handed to the background thread to save.
+void session_poll(void)
+{
+	MagCalSnapshot_t now;
+
+	if (session_path[0] == 0) return;
+	if ((double)(monotonic_ns() - last_save_ns) * 1e-9 < SESSION_SAVE_SECS) return;
+	last_save_ns = monotonic_ns();
+	// keep the file's calibration until this sensor has confirmed it
+	if (magcal_restore_pending()) return;
+	raw_data_snapshot(&now);
+	if (memcmp(&now, &saved, sizeof(now)) == 0) return;
+	memcpy(&saved, &now, sizeof(now));
+	queue_save();
+}
+
+// Save the session and calibration one last time and wait until they are
+// on disk.  Call before the port is closed or changed.
+void session_close(void)
+{
+	MagCalSnapshot_t now;
+
+	if (session_path[0] == 0) return;
+	calcache_save(session_id);
+	raw_data_snapshot(&now);
+	if (!magcal_restore_pending() && memcmp(&now, &saved, sizeof(now)) != 0) {
+		memcpy(&saved, &now, sizeof(now));
+		queue_save();
+	}
+	save_wait();
+	session_path[0] = 0;
+}
@@ -0,0 +1,94 @@
+// Follow the samples another MotionCal process publishes with -P
+//
+// Usage: shmtail [-s] [-n count] [-p usec] name
+//
+//   -s         print a summary each second instead of every record:
+//              records read and lost, and the latency from the writer
+//              reading the sample to this process seeing it
+//   -n count   stop after count records
+//   -p usec    sleep this long when no record is waiting (default 1000);
+//              0 spins, for the lowest latency
+//
+// Prints one line per sample: sample number, host time, calibration
+// generation, calibrated mag (uT), accel (g), gyro (deg/sec) and the
+// orientation quaternion.  Exits when the writer stops.
+
+#include "imuread.h"
+
+void calibration_confirmed(void)
+{
+}
+
+static void print_record(const PublishRecord_t *rec)
+{
+	printf("%llu %.6f %u  %.2f %.2f %.2f  %.4f %.4f %.4f  %.2f %.2f %.2f"
+		"  %.5f %.5f %.5f %.5f\n", (unsigned long long)rec->sample,
+		rec->host_ns * 1e-9, rec->generation,
+		rec->mag[0], rec->mag[1], rec->mag[2],
+		rec->accel[0], rec->accel[1], rec->accel[2],
+		rec->gyro[0], rec->gyro[1], rec->gyro[2],
+		rec->q.q0, rec->q.q1, rec->q.q2, rec->q.q3);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = NULL;
+	PublishReader_t r;
+	PublishRecord_t rec;
+	uint64_t count=0, limit=0, reported=0, lost=0, now, next_report;
+	double latency_sum=0.0, latency_max=0.0, latency;
+	int i, n, summary=0, poll_us=1000;
+
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0) summary = 1;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) limit = strtoull(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) poll_us = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && name == NULL) name = argv[i];
+		else goto usage;
+	}
+	if (name == NULL) goto usage;
+	if (!publish_open(&r, name)) {
+		fprintf(stderr, "shmtail: no MotionCal samples published as %s\n", name);
+		return 1;
+	}
+	if (!summary) {
+		printf("# writer pid %u, %.1f Hz, oversample %d\n", r.pid, r.rate, r.oversample);
+	}
+	next_report = monotonic_ns() + 1000000000ull;
+	while (limit == 0 || count < limit) {
+		n = publish_next(&r, &rec);
+		if (n == PUBLISH_CLOSED) break;
+		if (n == 1) {
+			count++;
+			if (!summary) {
+				print_record(&rec);
+			} else {
+				latency = (monotonic_ns() - rec.host_ns) * 1e-3;
+				latency_sum += latency;
+				if (latency > latency_max) latency_max = latency;
+			}
+		} else if (n == PUBLISH_LOST && !summary) {
+			printf("# lost %llu records\n", (unsigned long long)(r.lost - lost));
+			lost = r.lost;
+		} else if (n == 0 && poll_us > 0) {
+			usleep(poll_us);
+		}
+		if (summary && (now = monotonic_ns()) >= next_report) {
+			printf("%llu records, %llu lost, latency %.0f us avg %.0f us max\n",
+				(unsigned long long)(count - reported),
+				(unsigned long long)(r.lost - lost),
+				(count > reported) ? latency_sum / (count - reported) : 0.0,
+				latency_max);
+			fflush(stdout);
+			reported = count;
+			lost = r.lost;
+			latency_sum = latency_max = 0.0;
+			next_report = now + 1000000000ull;
+		}
+	}
+	publish_close(&r);
+	return 0;
+usage:
+	fprintf(stderr, "Usage: shmtail [-s] [-n count] [-p usec] name\n");
+	return 1;
+}
@@ -0,0 +1,267 @@
+#include "imuread.h"
+
+// Pipeline instrumentation: call counts and latency histograms for each
+// stage from the serial port read to the display, plus byte and sample
+// counters.  Stage times are inclusive, so parse contains raw_data, which
+// contains the calibration and fusion stages.  "photon" is not a stage
+// but the end to end latency: from the read() that brought in the newest
+// sample to the buffer swap that first shows it.  Build with -DNO_STATS
+// to compile all of it out of the hot path.
+
+static const char *stage_names[STAT_STAGES] = {
+	"read", "parse", "raw_data", "add_magcal", "evict", "solve",
+	"fusion", "display", "photon"
+};
+
+#ifndef NO_STATS
+
+// Log-linear buckets, like HdrHistogram: below 16 ns one bucket per ns,
+// above that 16 buckets per power of 2, so every value is recorded within
+// about 6%, up to 2^41 ns (36 minutes).
+#define STATS_SUB_BUCKETS 16
+#define STATS_BUCKETS     608
+#define STATS_DUMP_SECS   5.0
+
+typedef struct {
+	uint32_t count[STATS_BUCKETS];
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} StageHistogram_t;
+
+uint64_t stats_start[STAT_STAGES];
+uint64_t stats_counter[STAT_COUNTERS];
+static StageHistogram_t hist[STAT_STAGES];
+static uint64_t reset_ns;
+static uint64_t last_dump_ns;
+static uint64_t last_dump_counter[STAT_COUNTERS];
+static uint64_t last_shown_ns;
+static char dump_path[1024];
+
+static int bucket_index(uint64_t ns)
+{
+	int shift=0;
+
+	if (ns < STATS_SUB_BUCKETS) return (int)ns;
+	while ((ns >> shift) >= 2 * STATS_SUB_BUCKETS) shift++;
+	if (shift > 36) return STATS_BUCKETS - 1;
+	return (shift + 1) * STATS_SUB_BUCKETS + (int)(ns >> shift) - STATS_SUB_BUCKETS;
+}
+
+// the largest value a bucket holds
+static uint64_t bucket_limit(int index)
+{
+	int shift;
+
+	if (index < STATS_SUB_BUCKETS) return index;
+	shift = index / STATS_SUB_BUCKETS - 1;
+	return ((uint64_t)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void stats_record(int stage, uint64_t ns)
+{
+	StageHistogram_t *h = &hist[stage];
+
+	h->count[bucket_index(ns)]++;
+	h->calls++;
+	h->total_ns += ns;
+	if (ns > h->max_ns) h->max_ns = ns;
+}
+
+void stats_reset(void)
+{
+	memset(hist, 0, sizeof(hist));
+	memset(stats_counter, 0, sizeof(stats_counter));
+	memset(last_dump_counter, 0, sizeof(last_dump_counter));
+	reset_ns = last_dump_ns = monotonic_ns();
+}
+
+static uint64_t quantile(const StageHistogram_t *h, double q)
+{
+	uint64_t target, sum=0;
+	int i;
+
+	if (h->calls == 0) return 0;
+	target = (uint64_t)(q * (double)h->calls + 0.5);
+	if (target < 1) target = 1;
+	for (i=0; i < STATS_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum >= target) break;
+	}
+	if (i >= STATS_BUCKETS) return h->max_ns;
+	return (bucket_limit(i) < h->max_ns) ? bucket_limit(i) : h->max_ns;
+}
+
+void stats_stage(int stage, StageStats_t *out)
+{
+	const StageHistogram_t *h = &hist[stage];
+
+	out->name = stage_names[stage];
+	out->calls = h->calls;
+	out->mean_ns = h->calls ? (double)h->total_ns / h->calls : 0.0;
+	out->p50_ns = quantile(h, 0.50);
+	out->p90_ns = quantile(h, 0.90);
+	out->p99_ns = quantile(h, 0.99);
+	out->max_ns = h->max_ns;
+}
+
+uint64_t stats_count(int counter)
+{
+	return stats_counter[counter];
+}
+
+// Called right after the buffer swap, with the read time of the sample
+// the frame was drawn from (current_orientation_time.host_ns).  Only the
+// first frame showing each sample counts, so redraws without new data
+// don't inflate the latency.
+void stats_frame_shown(uint64_t sample_ns)
+{
+	if (sample_ns == 0 || sample_ns == last_shown_ns) return;
+	last_shown_ns = sample_ns;
+	stats_record(STAT_PHOTON, monotonic_ns() - sample_ns);
+}
+
+double stats_elapsed(void)
+{
+	if (reset_ns == 0) stats_reset();
+	return (double)(monotonic_ns() - reset_ns) * 1e-9;
+}
+
+// Prometheus text exposition format.  Written to a temporary file and
+// renamed over the real one, so a scraper never reads half a dump.
+int stats_dump(const char *path)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99};
+	static const char *counter_names[STAT_COUNTERS] = {"bytes", "samples"};
+	char tmp[1100];
+	FILE *fp;
+	StageHistogram_t *h;
+	double secs, now_secs;
+	uint64_t now;
+	int i, j;
+
+	now = monotonic_ns();
+	if (reset_ns == 0) stats_reset();
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) return 0;
+	fprintf(fp, "# HELP motioncal_stage_seconds Time spent in each pipeline stage, "
+		"including the stages it calls.\n");
+	fprintf(fp, "# TYPE motioncal_stage_seconds summary\n");
+	for (i=0; i < STAT_PHOTON; i++) {
+		h = &hist[i];
+		for (j=0; j < 3; j++) {
+			fprintf(fp, "motioncal_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+				stage_names[i], quantiles[j], quantile(h, quantiles[j]) * 1e-9);
+		}
+		fprintf(fp, "motioncal_stage_seconds_sum{stage=\"%s\"} %.9f\n",
+			stage_names[i], h->total_ns * 1e-9);
+		fprintf(fp, "motioncal_stage_seconds_count{stage=\"%s\"} %llu\n",
+			stage_names[i], (unsigned long long)h->calls);
+	}
+	fprintf(fp, "# HELP motioncal_stage_seconds_max Longest single call of each stage.\n");
+	fprintf(fp, "# TYPE motioncal_stage_seconds_max gauge\n");
+	for (i=0; i < STAT_PHOTON; i++) {
+		fprintf(fp, "motioncal_stage_seconds_max{stage=\"%s\"} %.9f\n",
+			stage_names[i], hist[i].max_ns * 1e-9);
+	}
+	h = &hist[STAT_PHOTON];
+	fprintf(fp, "# HELP motioncal_sensor_to_photon_seconds From the read() of the "
+		"newest sample to the first buffer swap showing it.\n");
+	fprintf(fp, "# TYPE motioncal_sensor_to_photon_seconds summary\n");
+	for (j=0; j < 3; j++) {
+		fprintf(fp, "motioncal_sensor_to_photon_seconds{quantile=\"%g\"} %.9f\n",
+			quantiles[j], quantile(h, quantiles[j]) * 1e-9);
+	}
+	fprintf(fp, "motioncal_sensor_to_photon_seconds_sum %.9f\n", h->total_ns * 1e-9);
+	fprintf(fp, "motioncal_sensor_to_photon_seconds_count %llu\n",
+		(unsigned long long)h->calls);
+	fprintf(fp, "# TYPE motioncal_sensor_to_photon_seconds_max gauge\n");
+	fprintf(fp, "motioncal_sensor_to_photon_seconds_max %.9f\n", h->max_ns * 1e-9);
+	secs = (double)(now - last_dump_ns) * 1e-9;
+	now_secs = (double)(now - reset_ns) * 1e-9;
+	for (i=0; i < STAT_COUNTERS; i++) {
+		fprintf(fp, "# TYPE motioncal_%s_total counter\n", counter_names[i]);
+		fprintf(fp, "motioncal_%s_total %llu\n", counter_names[i],
+			(unsigned long long)stats_counter[i]);
+		fprintf(fp, "# HELP motioncal_%s_per_second Rate since the previous dump.\n",
+			counter_names[i]);
+		fprintf(fp, "# TYPE motioncal_%s_per_second gauge\n", counter_names[i]);
+		fprintf(fp, "motioncal_%s_per_second %.1f\n", counter_names[i],
+			secs > 0.0 ? (stats_counter[i] - last_dump_counter[i]) / secs : 0.0);
+		last_dump_counter[i] = stats_counter[i];
+	}
+	fprintf(fp, "# TYPE motioncal_uptime_seconds gauge\n");
+	fprintf(fp, "motioncal_uptime_seconds %.3f\n", now_secs);
+	last_dump_ns = now;
+	if (fclose(fp) != 0) {
+		remove(tmp);
+		return 0;
+	}
+#if defined(WINDOWS)
+	remove(path);  // rename won't replace an existing file
+#endif
+	if (rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+// NULL uses the MOTIONCAL_STATS environment variable, if set
+void stats_set_dump_path(const char *path)
+{
+	if (path == NULL) path = getenv("MOTIONCAL_STATS");
+	if (path == NULL) path = "";
+	snprintf(dump_path, sizeof(dump_path), "%s", path);
+}
+
+// called from the GUI timer, dumps every STATS_DUMP_SECS
+void stats_poll(void)
+{
+	if (dump_path[0] == 0) return;
+	if (reset_ns == 0) stats_reset();
+	if ((double)(monotonic_ns() - last_dump_ns) * 1e-9 < STATS_DUMP_SECS) return;
+	stats_dump(dump_path);
+}
+
+#else // NO_STATS
+
+void stats_reset(void)
+{
+}
+
+void stats_stage(int stage, StageStats_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->name = stage_names[stage];
+}
+
+uint64_t stats_count(int counter)
+{
+	return 0;
+}
+
+double stats_elapsed(void)
+{
+	return 0.0;
+}
+
+int stats_dump(const char *path)
+{
+	return 0;
+}
+
+void stats_set_dump_path(const char *path)
+{
+}
+
+void stats_poll(void)
+{
+}
+
+void stats_frame_shown(uint64_t sample_ns)
+{
+}
+
+#endif // NO_STATS
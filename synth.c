@@ -0,0 +1,292 @@
+#include "imuread.h"
+
+// Synthetic accelerometer, gyro and magnetometer readings.  The sensor
+// follows a rotation trajectory in a fixed geomagnetic field, and the
+// magnetometer readings are distorted by a known hard and soft iron, so
+// the calibration recovered from them can be checked against the truth.
+
+static SynthConfig_t cfg;
+static Quaternion_t q;         // sensor to world rotation
+static float omega[3];         // body rotation rate (rad/s)
+static float field[3];         // geomagnetic field in the world frame (uT)
+static float dt;               // interval ending at the current sample
+static double t;
+static Prng_t rng;
+
+void synth_default(SynthConfig_t *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->rate = SENSORFS;
+	c->trajectory = SYNTH_RANDOMWALK;
+	c->rotation = 90.0f;
+	c->coverage = 45.0f;
+	c->V[0] = 21.5f;
+	c->V[1] = -13.0f;
+	c->V[2] = 42.0f;
+	c->W[0][0] = 1.06f;
+	c->W[0][1] = 0.03f;
+	c->W[0][2] = -0.02f;
+	c->W[1][0] = 0.03f;
+	c->W[1][1] = 0.96f;
+	c->W[1][2] = 0.04f;
+	c->W[2][0] = -0.02f;
+	c->W[2][1] = 0.04f;
+	c->W[2][2] = 1.01f;
+	c->B = 50.0f;
+	c->inclination = 60.0f;
+	c->noise = 0.3f;
+	c->outliers = 0.0f;
+	c->seed = 1;
+}
+
+static float synth_uniform(void)
+{
+	return prng_uniform(&rng);
+}
+
+static float synth_gauss(void)
+{
+	float u1, u2;
+
+	u1 = synth_uniform() + 1.0e-7f;
+	u2 = synth_uniform();
+	return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+void synth_init(const SynthConfig_t *c)
+{
+	float dip;
+
+	cfg = *c;
+	if (cfg.rate <= 0.0f) cfg.rate = SENSORFS;
+	dt = 1.0f / cfg.rate;
+	t = 0.0;
+	prng_seed(&rng, cfg.seed);
+	q.q0 = 1.0f;
+	q.q1 = q.q2 = q.q3 = 0.0f;
+	omega[0] = omega[1] = omega[2] = 0.0f;
+	dip = cfg.inclination * (float)(M_PI / 180.0);
+	field[0] = cfg.B * cosf(dip);
+	field[1] = 0.0f;
+	field[2] = -cfg.B * sinf(dip);
+}
+
+// world frame vector into the sensor frame: conj(q) v q
+static void to_body(const float v[3], float out[3])
+{
+	float r[3][3];
+
+	r[0][0] = 1.0f - 2.0f * (q.q2 * q.q2 + q.q3 * q.q3);
+	r[0][1] = 2.0f * (q.q1 * q.q2 - q.q0 * q.q3);
+	r[0][2] = 2.0f * (q.q1 * q.q3 + q.q0 * q.q2);
+	r[1][0] = 2.0f * (q.q1 * q.q2 + q.q0 * q.q3);
+	r[1][1] = 1.0f - 2.0f * (q.q1 * q.q1 + q.q3 * q.q3);
+	r[1][2] = 2.0f * (q.q2 * q.q3 - q.q0 * q.q1);
+	r[2][0] = 2.0f * (q.q1 * q.q3 - q.q0 * q.q2);
+	r[2][1] = 2.0f * (q.q2 * q.q3 + q.q0 * q.q1);
+	r[2][2] = 1.0f - 2.0f * (q.q1 * q.q1 + q.q2 * q.q2);
+	out[0] = r[0][0] * v[0] + r[1][0] * v[1] + r[2][0] * v[2];
+	out[1] = r[0][1] * v[0] + r[1][1] * v[1] + r[2][1] * v[2];
+	out[2] = r[0][2] * v[0] + r[1][2] * v[1] + r[2][2] * v[2];
+}
+
+// choose the body rotation rate for the next step
+static void trajectory(void)
+{
+	float speed, tilt, s, k;
+	int i;
+
+	speed = cfg.rotation * (float)(M_PI / 180.0);
+	switch (cfg.trajectory) {
+	  case SYNTH_FIGURE8:
+		// a lissajous wave about x and y, slowly turning about z
+		omega[0] = speed * sinf(2.0f * (float)M_PI * 0.25f * (float)t);
+		omega[1] = speed * sinf(2.0f * (float)M_PI * 0.5f * (float)t);
+		omega[2] = speed * 0.2f;
+		break;
+	  case SYNTH_STILL:
+		omega[0] = omega[1] = omega[2] = 0.0f;
+		break;
+	  case SYNTH_LIMITED:
+	  case SYNTH_RANDOMWALK:
+	  default:
+		// first order random process, about 1 second correlation time,
+		// with speed as the standard deviation of each axis
+		k = (dt < 1.0f) ? dt : 1.0f;
+		s = speed * sqrtf(2.0f * k);
+		for (i=0; i < 3; i++) {
+			omega[i] += -k * omega[i] + s * synth_gauss();
+		}
+		if (cfg.trajectory == SYNTH_LIMITED) {
+			// pull back towards the start once outside the cone
+			s = sqrtf(q.q1 * q.q1 + q.q2 * q.q2 + q.q3 * q.q3);
+			tilt = 2.0f * atan2f(s, fabsf(q.q0)) * (float)(180.0 / M_PI);
+			if (tilt > cfg.coverage && s > 0.0f) {
+				k = (q.q0 < 0.0f) ? speed / s : -speed / s;
+				omega[0] = k * q.q1;
+				omega[1] = k * q.q2;
+				omega[2] = k * q.q3;
+			}
+		}
+		break;
+	}
+}
+
+// q = q + 0.5 * q * (0, omega) * dt, renormalized
+static void rotate(void)
+{
+	Quaternion_t d;
+	float norm;
+
+	d.q0 = -q.q1 * omega[0] - q.q2 * omega[1] - q.q3 * omega[2];
+	d.q1 =  q.q0 * omega[0] + q.q2 * omega[2] - q.q3 * omega[1];
+	d.q2 =  q.q0 * omega[1] - q.q1 * omega[2] + q.q3 * omega[0];
+	d.q3 =  q.q0 * omega[2] + q.q1 * omega[1] - q.q2 * omega[0];
+	q.q0 += 0.5f * d.q0 * dt;
+	q.q1 += 0.5f * d.q1 * dt;
+	q.q2 += 0.5f * d.q2 * dt;
+	q.q3 += 0.5f * d.q3 * dt;
+	norm = 1.0f / sqrtf(q.q0 * q.q0 + q.q1 * q.q1 + q.q2 * q.q2 + q.q3 * q.q3);
+	q.q0 *= norm;
+	q.q1 *= norm;
+	q.q2 *= norm;
+	q.q3 *= norm;
+}
+
+static int16_t counts(float value, float per_count)
+{
+	value /= per_count;
+	if (value > 32767.0f) return 32767;
+	if (value < -32768.0f) return -32768;
+	return (int16_t)lrintf(value);
+}
+
+// the next reading, as 9 raw sensor counts in the "Raw:" field order
+void synth_sample(int16_t *data)
+{
+	static const float gravity[3] = {0.0f, 0.0f, 1.0f};
+	float g[3], b[3], m[3];
+	int i;
+
+	dt = 1.0f / cfg.rate;
+	if (cfg.jitter > 0.0f) {
+		// a sensor clocked by a busy main loop rather than a timer
+		dt *= 1.0f + cfg.jitter * synth_gauss();
+		if (dt < 0.25f / cfg.rate) dt = 0.25f / cfg.rate;
+	}
+	trajectory();
+	rotate();
+	t += dt;
+
+	to_body(gravity, g);
+	to_body(field, b);
+	for (i=0; i < 3; i++) {
+		m[i] = cfg.W[i][0] * b[0] + cfg.W[i][1] * b[1] + cfg.W[i][2] * b[2]
+			+ cfg.V[i] + cfg.Vdrift[i] * (float)t + cfg.noise * synth_gauss();
+	}
+	if (cfg.outliers > 0.0f && synth_uniform() < cfg.outliers) {
+		// a nearby magnet or motor: anything up to twice the field
+		for (i=0; i < 3; i++) {
+			m[i] = cfg.V[i] + (synth_uniform() * 4.0f - 2.0f) * cfg.B;
+		}
+	}
+	for (i=0; i < 3; i++) {
+		data[i] = counts(g[i] + 0.002f * synth_gauss(), G_PER_COUNT);
+		data[3+i] = counts(omega[i] * (float)(180.0 / M_PI)
+			+ 0.1f * synth_gauss(), DEG_PER_SEC_PER_COUNT);
+		data[6+i] = counts(m[i], UT_PER_COUNT);
+	}
+}
+
+void synth_orientation(Quaternion_t *out)
+{
+	*out = q;
+}
+
+// the sensor's microsecond clock, which wraps like the firmware's micros()
+uint32_t synth_time_us(void)
+{
+	return (uint32_t)(uint64_t)(t * 1.0e6);
+}
+
+// the calibration a perfect solver would find, at the current time
+void synth_truth(float V[3], float invW[3][3], float *B)
+{
+	int i;
+
+	for (i=0; i < 3; i++) {
+		V[i] = cfg.V[i] + cfg.Vdrift[i] * (float)t;
+	}
+	f3x3matrixAeqInvSymB(invW, cfg.W);
+	*B = cfg.B;
+}
+
+// "Raw:" line as the ASCII firmware prints it
+int synth_ascii(const int16_t *data, char *buf)
+{
+	if (cfg.timestamps) {
+		return sprintf(buf, "Raw:%d,%d,%d,%d,%d,%d,%d,%d,%d,%u\r\n",
+			data[0], data[1], data[2], data[3], data[4], data[5],
+			data[6], data[7], data[8], synth_time_us());
+	}
+	return sprintf(buf, "Raw:%d,%d,%d,%d,%d,%d,%d,%d,%d\r\n",
+		data[0], data[1], data[2], data[3], data[4], data[5],
+		data[6], data[7], data[8]);
+}
+
+static int frame(const unsigned char *payload, int len, unsigned char *buf)
+{
+	int i, n=0;
+
+	buf[n++] = 0x7E;
+	for (i=0; i < len; i++) {
+		if (payload[i] == 0x7E || payload[i] == 0x7D) {
+			buf[n++] = 0x7D;
+			buf[n++] = (payload[i] == 0x7E) ? 0x5E : 0x5D;
+		} else {
+			buf[n++] = payload[i];
+		}
+	}
+	buf[n++] = 0x7E;
+	return n;
+}
+
+static void put_int16(unsigned char *p, int16_t n)
+{
+	p[0] = n & 255;
+	p[1] = (n >> 8) & 255;
+}
+
+// the binary firmware's type 1 orientation packet and a type 6 packet
+// putting this magnetometer reading into buffer slot id; the binary
+// format carries no raw accel/gyro.  buf needs room for 152 bytes.
+int synth_binary(const int16_t *data, int id, unsigned char *buf)
+{
+	unsigned char payload[38];
+	uint32_t us;
+	int n;
+
+	memset(payload, 0, sizeof(payload));
+	payload[0] = 1;
+	put_int16(payload + 24, counts(q.q0, 1.0f / 30000.0f));
+	put_int16(payload + 26, counts(q.q1, 1.0f / 30000.0f));
+	put_int16(payload + 28, counts(q.q2, 1.0f / 30000.0f));
+	put_int16(payload + 30, counts(q.q3, 1.0f / 30000.0f));
+	if (cfg.timestamps) {
+		us = synth_time_us();
+		put_int16(payload + 34, us & 0xFFFF);
+		put_int16(payload + 36, us >> 16);
+		n = frame(payload, 38, buf);
+	} else {
+		n = frame(payload, 34, buf);
+	}
+
+	memset(payload, 0, sizeof(payload));
+	payload[0] = 6;
+	put_int16(payload + 6, id + 10);
+	put_int16(payload + 8, data[6]);
+	put_int16(payload + 10, data[7]);
+	put_int16(payload + 12, data[8]);
+	n += frame(payload, 14, buf + n);
+	return n;
+}
@@ -0,0 +1,176 @@
+#include "imuread.h"
+
+// Event tracer, for seeing individual stalls rather than the averages in
+// stats.c.  Each thread records into its own ring buffer, so recording
+// takes no lock: a span is pushed by TRACE_BEGIN and written as a single
+// complete event by TRACE_END.  trace_write() saves the newest events of
+// every thread in Chrome's trace event JSON format, which chrome://tracing
+// and ui.perfetto.dev open directly.  Compiled out with -DNO_STATS.
+
+#ifndef NO_STATS
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_EVENTS      65536  // per thread, power of 2
+#define TRACE_DEPTH       16     // nested spans per thread
+
+typedef struct {
+	const char *name;   // must be a string constant
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	int32_t arg;
+} TraceEvent_t;
+
+typedef struct {
+	TraceEvent_t event[TRACE_EVENTS];
+	volatile uint32_t count;       // events ever written, only the owner writes
+	uint64_t begin[TRACE_DEPTH];
+	int depth;
+	int tid;
+	const char *thread_name;
+} TraceBuffer_t;
+
+int trace_enabled=0;
+static TraceBuffer_t *buffers[TRACE_MAX_THREADS];
+static volatile int nbuffers=0;
+static uint64_t trace_start_ns;
+static char trace_path[1024];
+static __thread TraceBuffer_t *local;
+static __thread const char *local_name;
+
+static TraceBuffer_t * local_buffer(void)
+{
+	TraceBuffer_t *b;
+	int n;
+
+	if (local) return local;
+	n = __sync_fetch_and_add(&nbuffers, 1);
+	if (n >= TRACE_MAX_THREADS) return NULL;
+	b = (TraceBuffer_t *)calloc(1, sizeof(TraceBuffer_t));
+	if (b == NULL) return NULL;
+	b->tid = n + 1;
+	b->thread_name = local_name;
+	buffers[n] = b;
+	local = b;
+	return b;
+}
+
+// name the calling thread in the trace; a string constant
+void trace_thread_name(const char *name)
+{
+	local_name = name;
+	if (local) local->thread_name = name;
+}
+
+void trace_begin(void)
+{
+	TraceBuffer_t *b = local_buffer();
+
+	if (b == NULL) return;
+	if (b->depth < TRACE_DEPTH) b->begin[b->depth] = monotonic_ns();
+	b->depth++;
+}
+
+void trace_end(const char *name, int arg)
+{
+	TraceBuffer_t *b = local;
+	TraceEvent_t *e;
+	uint64_t now;
+
+	if (b == NULL || b->depth <= 0) return;
+	now = monotonic_ns();
+	if (--b->depth >= TRACE_DEPTH) return;
+	e = &b->event[b->count & (TRACE_EVENTS - 1)];
+	e->name = name;
+	e->start_ns = b->begin[b->depth];
+	e->dur_ns = now - e->start_ns;
+	e->arg = arg;
+	__sync_synchronize();  // the event is complete before it is counted
+	b->count++;
+}
+
+// Start recording.  path is where trace_write() saves by default, or NULL
+// for the MOTIONCAL_TRACE environment variable.  Returns 0 if neither
+// gives a path, and tracing stays off.
+int trace_start(const char *path)
+{
+	if (path == NULL) path = getenv("MOTIONCAL_TRACE");
+	if (path == NULL || *path == 0) return 0;
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+	if (trace_start_ns == 0) trace_start_ns = monotonic_ns();
+	if (local_name == NULL) trace_thread_name("main");
+	trace_enabled = 1;
+	return 1;
+}
+
+static void write_buffer(FILE *fp, TraceBuffer_t *b, int *first)
+{
+	TraceEvent_t e;
+	uint32_t i, count, start;
+
+	count = b->count;
+	__sync_synchronize();
+	// skip the oldest few, which the owner may be overwriting meanwhile
+	start = (count > TRACE_EVENTS) ? count - TRACE_EVENTS + TRACE_EVENTS / 16 : 0;
+	fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}}", *first ? "" : ",", b->tid,
+		b->thread_name ? b->thread_name : "thread");
+	*first = 0;
+	for (i=start; i != count; i++) {
+		e = b->event[i & (TRACE_EVENTS - 1)];
+		if (e.start_ns < trace_start_ns) continue;
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%d}}", e.name, b->tid,
+			(e.start_ns - trace_start_ns) * 0.001, e.dur_ns * 0.001, e.arg);
+	}
+}
+
+// Save the newest events of every thread.  Recording continues.
+int trace_write(const char *path)
+{
+	char tmp[1100];
+	FILE *fp;
+	int i, n, first=1;
+
+	if (path == NULL) path = trace_path;
+	if (*path == 0) return 0;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) return 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	n = nbuffers;
+	if (n > TRACE_MAX_THREADS) n = TRACE_MAX_THREADS;
+	for (i=0; i < n; i++) {
+		if (buffers[i]) write_buffer(fp, buffers[i], &first);
+	}
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) != 0) {
+		remove(tmp);
+		return 0;
+	}
+#if defined(WINDOWS)
+	remove(path);
+#endif
+	if (rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+#else // NO_STATS
+
+void trace_thread_name(const char *name)
+{
+}
+
+int trace_start(const char *path)
+{
+	return 0;
+}
+
+int trace_write(const char *path)
+{
+	return 0;
+}
+
+#endif // NO_STATS
@@ -0,0 +1,268 @@
+// Time-to-calibration benchmark
+//
+// Usage: ttcbench [-c chunk] [-R rate] [-O ratio] [-m] [-r] [-t tau] [-g uT] [-p policy] [-S seed] [-P usec]
+//                 [-s secs] session_or_directory ...
+//
+// Replays captured serial sessions (the raw bytes a port delivered, in
+// either wire format) through the same parser and raw_data() path the GUI
+// uses, and records the sample at which each of the 4 quality metrics
+// first meets the threshold MyFrame::OnTimer requires before "Send Cal"
+// is enabled.  One JSON object per session is printed, then a summary.
+// Session recordings (imuread -w) are decoded straight into raw_data()
+// with the times they were recorded with.
+//
+//   -c chunk   bytes handed to the parser per read (default 1, so every
+//              sample is checked exactly when it arrives)
+//   -R rate    sample rate of the sessions (default 100)
+//   -O ratio   gyro readings per orientation update (default 4)
+//   -m         multi-hypothesis solving
+//   -r         Levenberg-Marquardt refinement
+//   -t tau     continuous calibration with a tau second memory
+//   -g uT      novelty gate distance (default 1.0, 0 = off)
+//   -p policy  buffer retention policy: classic (default), coverage or
+//              reservoir
+//   -S seed    seed for the calibration's random choices (default 1)
+//   -P usec    schedule solves as if each took usec rather than by their
+//              measured cost, so runs are bit-reproducible
+//   -s secs    recordings only: start this far in, from the calibration
+//              buffer snapshot of the block holding that time
+
+#include "imuread.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MAX_SESSIONS 4096
+
+typedef struct {
+	uint32_t samples;     // samples replayed
+	int32_t gaps;         // first sample each metric was met, -1 = never
+	int32_t variance;
+	int32_t wobble;
+	int32_t fiterror;
+	int32_t all;          // first sample all 4 were met together
+	double cpu_secs;      // process CPU time for the whole replay
+	double solve_secs;    // part of it spent in the calibration solvers
+	double quality_secs;  // part of it spent recomputing quality metrics
+	uint32_t solves;
+} TTCResult_t;
+
+static int chunk = 1;
+static double start_secs = 0.0;
+static int32_t all_met[MAX_SESSIONS];
+static int nsessions = 0;
+static int ncalibrated = 0;
+static double total_cpu = 0.0;
+static double total_samples = 0.0;
+
+void calibration_confirmed(void)
+{
+}
+
+static void first_met(int32_t *index, int met, uint32_t sample)
+{
+	if (met && *index < 0) *index = sample;
+}
+
+// check the quality metrics, if a new sample has arrived
+static void check_sample(TTCResult_t *r, uint32_t *samples, uint64_t *qns)
+{
+	MagCalSched_t stats;
+	float gaps, variance, wobble, fiterror;
+	uint64_t t0;
+
+	magcal_sched_stats(&stats);
+	if (stats.samples == *samples) return;
+	*samples = stats.samples;
+	t0 = monotonic_ns();
+	quality_refresh();
+	gaps = quality_surface_gap_error();
+	variance = quality_magnitude_variance_error();
+	wobble = quality_wobble_error();
+	fiterror = quality_spherical_fit_error();
+	*qns += monotonic_ns() - t0;
+	first_met(&r->gaps, gaps < QUALITY_GAPS_OK, *samples);
+	first_met(&r->variance, variance < QUALITY_VARIANCE_OK, *samples);
+	first_met(&r->wobble, wobble < QUALITY_WOBBLE_OK, *samples);
+	first_met(&r->fiterror, fiterror < QUALITY_FITERROR_OK, *samples);
+	first_met(&r->all, gaps < QUALITY_GAPS_OK && variance < QUALITY_VARIANCE_OK
+	  && wobble < QUALITY_WOBBLE_OK && fiterror < QUALITY_FITERROR_OK, *samples);
+}
+
+static void replay_recording(RecReader_t *rd, TTCResult_t *r, uint32_t *samples, uint64_t *qns)
+{
+	RecRecord_t rec;
+	int first=1;
+
+	if (start_secs > 0.0) recording_seek(rd, start_secs);
+	while (recording_next(rd, &rec)) {
+		if (rec.type == REC_SNAPSHOT && first && start_secs > 0.0) {
+			raw_data_restore(&rec.cal);
+		} else if (rec.type == REC_SAMPLE) {
+			raw_data_timed(rec.data, rec.has_time ? &rec.time : NULL);
+			check_sample(r, samples, qns);
+		}
+		first = 0;
+	}
+}
+
+static int replay_session(const char *filename, TTCResult_t *r)
+{
+	FILE *fp=NULL;
+	RecReader_t rd;
+	unsigned char buf[4096];
+	MagCalSched_t stats;
+	uint32_t samples=0;
+	uint64_t qns=0;
+	clock_t c0;
+	int n, recording;
+
+	recording = recording_open(&rd, filename);
+	if (!recording) {
+		fp = fopen(filename, "rb");
+		if (fp == NULL) return 0;
+	}
+	memset(r, 0, sizeof(*r));
+	r->gaps = r->variance = r->wobble = r->fiterror = r->all = -1;
+	raw_data_reset();
+	newdata_reset();
+	c0 = clock();
+	if (recording) {
+		replay_recording(&rd, r, &samples, &qns);
+		recording_close(&rd);
+	} else {
+		while ((n = fread(buf, 1, chunk, fp)) > 0) {
+			// no host timestamps: replay at the nominal rate, or the sensor clock
+			newdata_timed(buf, n, 0);
+			check_sample(r, &samples, &qns);
+		}
+		fclose(fp);
+	}
+	r->cpu_secs = (double)(clock() - c0) / CLOCKS_PER_SEC;
+	magcal_sched_stats(&stats);
+	r->samples = stats.samples;
+	r->solve_secs = stats.solve_secs;
+	r->solves = stats.solves;
+	r->quality_secs = (double)qns * 1e-9;
+	return 1;
+}
+
+static void print_session(const char *filename, const TTCResult_t *r)
+{
+	printf("{\"session\":\"%s\",\"samples\":%u,\"gaps\":%d,\"variance\":%d,"
+		"\"wobble\":%d,\"fiterror\":%d,\"all\":%d,\"all_secs\":%.2f,"
+		"\"cpu_secs\":%.4f,\"solve_secs\":%.4f,\"quality_secs\":%.4f,"
+		"\"solves\":%u}\n", filename, r->samples, r->gaps, r->variance,
+		r->wobble, r->fiterror, r->all,
+		r->all < 0 ? -1.0 : (double)r->all / raw_data_rate(),
+		r->cpu_secs, r->solve_secs, r->quality_secs, r->solves);
+	fflush(stdout);
+}
+
+static void session(const char *filename)
+{
+	TTCResult_t r;
+
+	if (!replay_session(filename, &r)) {
+		fprintf(stderr, "ttcbench: unable to read %s\n", filename);
+		return;
+	}
+	print_session(filename, &r);
+	if (ncalibrated < MAX_SESSIONS && r.all >= 0) {
+		all_met[ncalibrated++] = r.all;
+	}
+	nsessions++;
+	total_cpu += r.cpu_secs;
+	total_samples += r.samples;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+static int select_file(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+static void session_or_directory(const char *path)
+{
+	struct dirent **list;
+	struct stat st;
+	char name[1024];
+	int i, n;
+
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		// sorted, so the output of two runs lines up for diff
+		n = scandir(path, &list, select_file, alphasort);
+		for (i=0; i < n; i++) {
+			snprintf(name, sizeof(name), "%s/%s", path, list[i]->d_name);
+			if (stat(name, &st) == 0 && S_ISREG(st.st_mode)) session(name);
+			free(list[i]);
+		}
+		if (n >= 0) free(list);
+	} else {
+		session(path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	float rate=SENSORFS, novelty=-1.0f;
+	uint64_t seed=1;
+	int i, ratio=OVERSAMPLE_RATIO;
+
+	raw_data_reset();
+	for (i=1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			chunk = atoi(argv[++i]);
+			if (chunk < 1) chunk = 1;
+			if (chunk > 4096) chunk = 4096;
+		} else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-O") == 0 && i + 1 < argc) {
+			ratio = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0) {
+			magcal_set_multi(1);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			magcal_set_refine(1);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			magcal_set_continuous(atof(argv[++i]));
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			novelty = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			if (!retention_set_policy(argv[++i])) goto usage;
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			magcal_set_sched_cost(atof(argv[++i]));
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			start_secs = atof(argv[++i]);
+		} else {
+			goto usage;
+		}
+	}
+	if (!raw_data_set_rate(rate, ratio)) {
+		fprintf(stderr, "ttcbench: bad sample rate or oversample ratio\n");
+		return 1;
+	}
+	if (novelty >= 0.0f) raw_data_set_novelty(novelty);
+	raw_data_set_seed(seed);
+	for (; i < argc; i++) {
+		session_or_directory(argv[i]);
+	}
+	qsort(all_met, ncalibrated, sizeof(int32_t), compare_samples);
+	printf("{\"policy\":\"%s\",\"sessions\":%d,\"calibrated\":%d,"
+		"\"median_all\":%d,\"median_all_secs\":%.2f,\"cpu_secs\":%.4f,"
+		"\"us_per_sample\":%.2f}\n", retention_policy_name(), nsessions,
+		ncalibrated, ncalibrated ? all_met[ncalibrated / 2] : -1,
+		ncalibrated ? (double)all_met[ncalibrated / 2] / raw_data_rate() : -1.0,
+		total_cpu, total_samples ? total_cpu * 1e6 / total_samples : 0.0);
+	return 0;
+usage:
+	fprintf(stderr, "Usage: ttcbench [-c chunk] [-R rate] [-O ratio] [-m] [-r] "
+		"[-t tau] [-g uT] [-p classic|coverage|reservoir] [-S seed] [-P usec]\n"
+		"  [-s secs] session_or_directory ...\n");
+	return 1;
+}
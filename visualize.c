@@ -1,21 +1,12 @@
 #include "imuread.h"
+#if defined(MACOSX)
+  #include <OpenGL/gl.h>
+  #include <OpenGL/glu.h>
+#else
+  #include <GL/gl.h>  // sudo apt install mesa-common-dev
+  #include <GL/glu.h> // sudo apt install libglu1-mesa-dev freeglut3-dev
+#endif
 
-MagCalibration_t magcal;
-
-Quaternion_t current_orientation;
-
-
-void apply_calibration(int16_t rawx, int16_t rawy, int16_t rawz, Point_t *out)
-{
-	float x, y, z;
-
-	x = ((float)rawx * UT_PER_COUNT) - magcal.V[0];
-	y = ((float)rawy * UT_PER_COUNT) - magcal.V[1];
-	z = ((float)rawz * UT_PER_COUNT) - magcal.V[2];
-	out->x = x * magcal.invW[0][0] + y * magcal.invW[0][1] + z * magcal.invW[0][2];
-	out->y = x * magcal.invW[1][0] + y * magcal.invW[1][1] + z * magcal.invW[1][2];
-	out->z = x * magcal.invW[2][0] + y * magcal.invW[2][1] + z * magcal.invW[2][2];
-}
 
 static void quad_to_rotation(const Quaternion_t *quat, float *rmatrix)
 {
@@ -63,6 +54,8 @@ void display_callback(void)
 	Point_t point, draw;
 	Quaternion_t orientation;
 
+	STAT_BEGIN(STAT_DISPLAY);
+	TRACE_BEGIN();
 	quality_reset();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glColor3f(1, 0, 0);	// set current color to red
@@ -134,6 +127,8 @@ void display_callback(void)
 		quality_wobble_error(),
 		quality_spherical_fit_error());
 #endif
+	TRACE_END("display", 0);
+	STAT_END(STAT_DISPLAY);
 }
 
 void resize_callback(int width, int height)